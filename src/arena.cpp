@@ -0,0 +1,54 @@
+// arena.cpp
+
+
+#include "arena.h"
+
+#include <cstdlib>
+
+
+// Start a new block, which is large enough for an allocation of
+// 'size' bytes even if that's more than ARENA_BLOCK_SIZE.  The rest
+// of the current block is abandoned.
+
+void *Arena::allocFromNewBlock( size_t size, size_t alignment )
+
+{
+  size_t dataSize = size + alignment;
+  if (dataSize < ARENA_BLOCK_SIZE)
+    dataSize = ARENA_BLOCK_SIZE;
+
+  Block *b = (Block *) malloc( sizeof(Block) + dataSize );
+  if (b == NULL)
+    throw std::bad_alloc();
+
+  b->next = blocks;
+  b->size = dataSize;
+  blocks = b;
+
+  numBytesReserved += dataSize;
+
+  next = (char *) (b+1);
+  end = next + dataSize;
+
+  char *p = (char *) (((size_t) next + alignment-1) & ~(alignment-1));
+  next = p + size;
+  numBytesUsed += size;
+
+  return p;
+}
+
+
+// Free all blocks
+
+void Arena::clear()
+
+{
+  while (blocks != NULL) {
+    Block *b = blocks;
+    blocks = b->next;
+    free( b );
+  }
+
+  next = end = NULL;
+  numBytesUsed = numBytesReserved = 0;
+}
@@ -0,0 +1,82 @@
+// arena.h
+//
+// A bump allocator.  Memory is handed out from large blocks and is
+// never freed individually; clear() frees all of it at once.
+//
+// This is for the many small, short-lived allocations of building a
+// BVH, which would otherwise each be a separate new and delete.  Only
+// types with trivial destructors should be allocated here, since no
+// destructors are run.
+
+
+#ifndef ARENA_H
+#define ARENA_H
+
+
+#include <cstddef>
+#include <new>
+
+
+#define ARENA_BLOCK_SIZE (256 * 1024) // bytes
+
+
+class Arena {
+
+  class Block {
+   public:
+    Block *next;		// previously filled block
+    size_t size;		// bytes of data after this header
+  };
+
+  Block *blocks;		// current block, followed by earlier ones
+  char  *next;			// next free byte in the current block
+  char  *end;			// end of the current block
+
+  size_t numBytesUsed;		// bytes allocated since clear()
+  size_t numBytesReserved;	// bytes in all blocks
+
+  void *allocFromNewBlock( size_t size, size_t alignment );
+
+ public:
+
+  Arena() {
+    blocks = NULL;
+    next = end = NULL;
+    numBytesUsed = numBytesReserved = 0;
+  }
+
+  ~Arena() {
+    clear();
+  }
+
+  Arena( const Arena & ) = delete;
+  Arena &operator=( const Arena & ) = delete;
+
+  void *alloc( size_t size, size_t alignment ) {
+    if (next == NULL)		// no block yet
+      return allocFromNewBlock( size, alignment );
+    char *p = (char *) (((size_t) next + alignment-1) & ~(alignment-1));
+    if (p > end || size > (size_t) (end - p))
+      return allocFromNewBlock( size, alignment );
+    next = p + size;
+    numBytesUsed += size;
+    return p;
+  }
+
+  // An array of n default-constructed T
+
+  template<class T> T *alloc( size_t n ) {
+    T *p = (T *) alloc( n * sizeof(T), alignof(T) );
+    for (size_t i=0; i<n; i++)
+      new (&p[i]) T();
+    return p;
+  }
+
+  void clear();
+
+  size_t bytesUsed()     { return numBytesUsed; }
+  size_t bytesReserved() { return numBytesReserved; }
+};
+
+
+#endif
@@ -9,6 +9,13 @@
 
 #include "linalg.h"
 
+#include <cfloat>
+#include <cmath>
+
+#ifndef MAXFLOAT
+  #define MAXFLOAT FLT_MAX
+#endif
+
 
 class BBox {
 
@@ -24,6 +31,62 @@ class BBox {
     max = c1;
   }
 
+  // An empty box, which any expand() replaces
+
+  void makeEmpty() {
+    min = vec3(  MAXFLOAT,  MAXFLOAT,  MAXFLOAT );
+    max = vec3( -MAXFLOAT, -MAXFLOAT, -MAXFLOAT );
+  }
+
+  void expand( vec3 const& p ) {
+    min = componentMin( p, min );
+    max = componentMax( p, max );
+  }
+
+  void expand( BBox const& b ) {
+    expand( b.min );
+    expand( b.max );
+  }
+
+  vec3 centre() const {
+    return 0.5 * (min + max);
+  }
+
+  float surfaceArea() const {
+    vec3 d = max - min;
+    if (d.x < 0 || d.y < 0 || d.z < 0)
+      return 0; // empty
+    return 2 * (d.x*d.y + d.y*d.z + d.z*d.x);
+  }
+
+  // Slab test of a ray against the box.  'invDir' is 1/rayDir, per
+  // component.  Returns the parameter at which the ray enters the box
+  // in 'tNear'.  Hits beyond 'tmax' are not counted.
+
+  bool rayInt( vec3 const& rayStart, vec3 const& invDir, float tmax, float &tNear ) const {
+
+    float tmin = 0;
+
+    for (int i=0; i<3; ++i) {
+
+      float t0 = (min[i] - rayStart[i]) * invDir[i];
+      float t1 = (max[i] - rayStart[i]) * invDir[i];
+
+      if (invDir[i] < 0.0f) {
+        float temp = t1; t1 = t0; t0 = temp;
+      }
+
+      tmin = (t0 > tmin) ? t0 : tmin; // farthest min distance
+      tmax = (t1 < tmax) ? t1 : tmax; // closest max distance
+
+      if (tmax < tmin) // crossing outside an edge (or corner)
+        return false;
+    }
+
+    tNear = tmin;
+    return true;
+  }
+
   void renderGL( mat4 &WCS_to_VCS, mat4 &WCS_to_CCS, vec3 lightDir );
 };
 
@@ -0,0 +1,244 @@
+// benchmark.cpp
+
+
+#include "headers.h"
+#include "benchmark.h"
+#include "main.h"
+#include "bvh.h"
+#include "wavefrontobj.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+
+
+#define BENCHMARK_DIR "worlds" // scenes benchmarked if none are given
+
+
+#ifdef _WIN32
+
+void runBenchmark( const char *reportFilename, seq<char*> &sceneFilenames, int width, int height )
+
+{
+  cerr << "The benchmark needs fork(), so it is not available on Windows." << endl;
+  exit(1);
+}
+
+#else
+
+
+// Find the scene files in BENCHMARK_DIR.  These are the files with no
+// '.' in their names; the others are models, materials, and textures.
+
+static void findBenchmarkScenes( seq<char*> &sceneFilenames )
+
+{
+  DIR *dir = opendir( BENCHMARK_DIR );
+
+  if (dir == NULL) {
+    cerr << "Could not open the '" BENCHMARK_DIR "' directory to find the benchmark scenes." << endl;
+    exit(1);
+  }
+
+  struct dirent *entry;
+
+  while ((entry = readdir( dir )) != NULL)
+    if (entry->d_name[0] != '\0' && strchr( entry->d_name, '.' ) == NULL) {
+      char *path = new char[ strlen( BENCHMARK_DIR ) + strlen( entry->d_name ) + 2 ];
+      sprintf( path, "%s/%s", BENCHMARK_DIR, entry->d_name );
+      sceneFilenames.add( path );
+    }
+
+  closedir( dir );
+
+  std::sort( sceneFilenames.begin(), sceneFilenames.end(),
+             []( const char *a, const char *b ) { return strcmp( a, b ) < 0; } );
+}
+
+
+// Write a string as a JSON string
+
+static void writeJSONString( ostream &out, const char *s )
+
+{
+  out << '"';
+
+  for (; *s != '\0'; s++)
+    if (*s == '"' || *s == '\\')
+      out << '\\' << *s;
+    else if ((unsigned char) *s < ' ')
+      out << ' ';
+    else
+      out << *s;
+
+  out << '"';
+}
+
+
+static double msSince( std::chrono::steady_clock::time_point start )
+
+{
+  return std::chrono::duration<double,std::milli>( std::chrono::steady_clock::now() - start ).count();
+}
+
+
+// Read and render one scene in this process, and write the JSON
+// fields of its measurements to 'fd'.  Called in the child.
+
+static void benchmarkScene( char *sceneFilename, int width, int height, int fd )
+
+{
+  auto startTime = std::chrono::steady_clock::now();
+
+  filename[0] = sceneFilename;
+  filename[1] = NULL;
+
+  readScene();
+
+  double loadTime = msSince( startTime );
+
+  scene->rayCounts = RayCounts();
+
+  float renderTime = scene->renderImage( width, height );
+
+  double wallTime = msSince( startTime );
+
+  cout << "\r" << renderTime << " seconds" << endl;
+
+  RayCounts &counts = scene->rayCounts;
+
+  stringstream fields;
+
+  fields << "\"loadMs\": " << loadTime << ", "
+	 << "\"bvhBuildMs\": " << BVH::totalBuildTime * 1000 << ", "
+	 << "\"renderMs\": " << renderTime * 1000 << ", "
+	 << "\"wallMs\": " << wallTime << ", "
+	 << "\"primaryRays\": " << counts.primary << ", "
+	 << "\"shadowRays\": " << counts.shadow << ", "
+	 << "\"secondaryRays\": " << counts.secondary << ", "
+	 << "\"mraysPerSec\": " << (renderTime > 0 ? counts.total() / renderTime / 1e6 : 0);
+
+  string s = fields.str();
+
+  for (size_t done=0; done < s.size(); ) {
+    ssize_t n = write( fd, s.c_str() + done, s.size() - done );
+    if (n <= 0)
+      break;
+    done += n;
+  }
+}
+
+
+// Benchmark each scene in 'sceneFilenames' (or each scene in
+// BENCHMARK_DIR if there are none) and write the report.
+//
+// The scenes are run in child processes, which must be forked before
+// this process starts any threads.
+
+void runBenchmark( const char *reportFilename, seq<char*> &sceneFilenames, int width, int height )
+
+{
+  if (sceneFilenames.size() == 0)
+    findBenchmarkScenes( sceneFilenames );
+
+  // Parse each model and build its BVH, so that the load and build
+  // times do not depend on whether a cache file was left by an
+  // earlier run
+
+  WavefrontObj::useCache = false;
+
+  ofstream out( reportFilename );
+
+  if (!out) {
+    cerr << "Could not open " << reportFilename << " to write the benchmark report." << endl;
+    exit(1);
+  }
+
+  out << "{" << endl
+      << "  \"width\": " << width << "," << endl
+      << "  \"height\": " << height << "," << endl
+      << "  \"samplesPerPixel\": " << scene->numPixelSamples * scene->numPixelSamples << "," << endl
+      << "  \"targetNoise\": " << scene->targetNoise << "," << endl
+      << "  \"seed\": " << scene->randomSeed << "," << endl
+      << "  \"threads\": " << scene->numThreads << "," << endl
+      << "  \"scenes\": [";
+
+  for (int i=0; i<sceneFilenames.size(); i++) {
+
+    cout << "Benchmarking " << sceneFilenames[i] << endl;
+
+    int fds[2];
+
+    if (pipe( fds ) != 0) {
+      cerr << "Could not create a pipe for the benchmark." << endl;
+      exit(1);
+    }
+
+    cout.flush();
+    cerr.flush();
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+      cerr << "Could not fork a process for the benchmark." << endl;
+      exit(1);
+    }
+
+    if (pid == 0) {		// child
+      close( fds[0] );
+      benchmarkScene( sceneFilenames[i], width, height, fds[1] );
+      close( fds[1] );
+      cout.flush();
+      _exit(0);
+    }
+
+    // Collect the child's fields, then its peak memory
+
+    close( fds[1] );
+
+    string fields;
+    char buff[1024];
+    ssize_t n;
+
+    while ((n = read( fds[0], buff, sizeof(buff) )) > 0)
+      fields.append( buff, n );
+
+    close( fds[0] );
+
+    int status;
+    struct rusage usage;
+
+    if (wait4( pid, &status, 0, &usage ) < 0)
+      status = -1;
+
+#ifdef MACOS
+    long peakKB = usage.ru_maxrss / 1024; // (bytes on MacOS)
+#else
+    long peakKB = usage.ru_maxrss;        // (kilobytes on Linux)
+#endif
+
+    out << (i == 0 ? "" : ",") << endl
+	<< "    { \"scene\": ";
+    writeJSONString( out, sceneFilenames[i] );
+
+    if (status == 0 && fields.size() > 0)
+      out << ", " << fields << ", \"peakRSSKB\": " << peakKB << " }";
+    else {
+      out << ", \"error\": \"failed\" }";
+      cerr << "Benchmark of " << sceneFilenames[i] << " failed." << endl;
+    }
+  }
+
+  out << endl << "  ]" << endl << "}" << endl;
+
+  cout << "Wrote benchmark report to " << reportFilename << endl;
+}
+
+#endif
@@ -0,0 +1,23 @@
+// benchmark.h
+//
+// Headless benchmark over a set of scenes.
+//
+// Each scene is read and ray traced from its 'eye' with the current
+// options (image size, samples per pixel, seed, threads) in a child
+// process of its own, so that the peak memory of one scene isn't
+// hidden by that of an earlier one.  The results are written to a
+// JSON file, one record per scene, so that they can be compared
+// across builds.
+
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+
+#include "seq.h"
+
+
+void runBenchmark( const char *reportFilename, seq<char*> &sceneFilenames, int width, int height );
+
+
+#endif
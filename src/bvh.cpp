@@ -3,12 +3,325 @@
 
 #include "bvh.h"
 #include "triangle.h"
+#include "main.h"
+
+#include <chrono>
+
+#if defined(__AVX__) || defined(__SSE2__)
+  #include <immintrin.h>
+#endif
 
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
 
 
+bool  BVH::useSAH           = true;
+int   BVH::numSAHBins       = 16;
+int   BVH::maxLeafSize      = 4;
+float BVH::traversalCost    = 0.5;
+float BVH::intersectionCost = 1;
+
+double BVH::totalBuildTime = 0;
+
+
+
+// Build the BVH over all triangles, and report the build time and the
+// SAH cost of the resulting tree so that builders can be compared.
+
+void BVH::buildTree()
+
+{
+  if (triangles.size() == 0) {
+    root = NULL;
+    return;
+  }
+
+  auto startTime = std::chrono::steady_clock::now();
+
+  // Everything used only during the build comes from 'arena' and is
+  // freed at once at the end.
+  //
+  // All triangle indices are in one array.  Each subtree's triangles
+  // are a contiguous range of it, which the builders partition in
+  // place (with 'scratch') before building the children.  A leaf
+  // refers to its range.
+
+  int n = triangles.size();
+
+  int *triangleIndices = arena.alloc<int>( n );
+  scratch = arena.alloc<int>( n );
+
+  for (int i=0; i<n; i++)
+    triangleIndices[i] = i;
+
+  // Build the tree
+
+  if (useSAH) {
+
+    triBoxes = arena.alloc<BBox>( n );
+    triCentroids = arena.alloc<vec3>( n );
+
+    binCount   = arena.alloc<int>( numSAHBins );
+    binBox     = arena.alloc<BBox>( numSAHBins );
+    rightArea  = arena.alloc<float>( numSAHBins );
+    rightCount = arena.alloc<int>( numSAHBins );
+
+    for (int i=0; i<n; i++) {
+      triBoxes[i] = triangleBBox( i );
+      triCentroids[i] = triBoxes[i].centre();
+    }
+
+    root = buildSAHSubtree( triangleIndices, n, 0 );
+
+  } else
+
+    root = buildSubtree( triangleIndices, n, 0 );
+
+  float cost = sahCost( root, root->bbox.surfaceArea() );
+
+  // Compact the tree for traversal
+
+  flattenTree();
+  buildWideTree();
+  buildTriangleBlocks();
+
+  size_t arenaBytes = arena.bytesUsed();
+
+  arena.clear();
+  scratch = NULL;
+  triBoxes = NULL;
+  triCentroids = NULL;
+  binCount = rightCount = NULL;
+  binBox = NULL;
+  rightArea = NULL;
+
+  float buildTime = std::chrono::duration<float>( std::chrono::steady_clock::now() - startTime ).count();
+
+  totalBuildTime += buildTime;
+
+  cout << "BVH: " << triangles.size() << " triangles, "
+       << (useSAH ? "SAH" : "clustering") << " build " << buildTime * 1000 << " ms "
+       << "using " << (arenaBytes + 1023) / 1024 << " KB, "
+       << "SAH cost " << cost << ", " << wideNodes.size() << " nodes of width " << BVH_WIDTH << endl;
+}
+
+
+
+// Copy the tree into the 'nodes' array and reorder 'triangles' so
+// that each leaf's triangles are contiguous.
+
+void BVH::flattenTree()
+
+{
+  seq<BVH_triangle> orderedTriangles( triangles.size() );
+
+  nodes.clear();
+  nodes.add( BVH_flatNode() );
+
+  flattenSubtree( root, 0, orderedTriangles );
+
+  triangles = orderedTriangles;
+  nodes.compress();
+
+  root = NULL; // (freed with the arena)
+}
+
+
+
+// Fill in triBlocks from the (reordered) triangles, with each leaf's
+// triangles starting a new block
+
+void BVH::buildTriangleBlocks()
+
+{
+  triBlocks.clear();
+
+  int numBlocks = 0;
+
+  for (int i=0; i<leaves.size(); i++) {
+    leaves[i].block = numBlocks;
+    numBlocks += (leaves[i].count + BVH_TRI_BLOCK-1) / BVH_TRI_BLOCK;
+  }
+
+  seq<BVH_triBlock> blocks( numBlocks );
+  blocks.resize( numBlocks ); // (all zero)
+
+  for (int i=0; i<leaves.size(); i++)
+    for (int j=0; j<leaves[i].count; j++) {
+
+      BVH_triangle &tri = triangles[ leaves[i].offset + j ];
+      BVH_triBlock &b = blocks[ leaves[i].block + j / BVH_TRI_BLOCK ];
+      int slot = j % BVH_TRI_BLOCK;
+
+      vec3 v0 = (*vertices)[ tri.v0 ];
+      vec3 e1 = (*vertices)[ tri.v1 ] - v0;
+      vec3 e2 = (*vertices)[ tri.v2 ] - v0;
+
+      for (int k=0; k<3; k++) {
+        b.v0[k][slot] = v0[k];
+        b.e1[k][slot] = e1[k];
+        b.e2[k][slot] = e2[k];
+      }
+    }
+
+  triBlocks = std::move( blocks );
+}
+
+
+
+// Collapse the flattened tree into the wide tree used for traversal
+
+void BVH::buildWideTree()
+
+{
+  wideNodes.clear();
+  leaves.clear();
+
+  wideRoot = buildWideSubtree( 0, stackSize );
+
+  wideNodes.compress();
+  leaves.compress();
+}
+
+
+
+// Build the wide subtree for nodes[flatIndex] and return a reference
+// to it.  A wide node's children are found by repeatedly replacing
+// the largest interior child with its own children, for as long as
+// they fit in BVH_WIDTH slots.
+//
+// 'stackNeeded' is returned with the traversal stack size needed for
+// this subtree.
+
+int BVH::buildWideSubtree( int flatIndex, int &stackNeeded )
+
+{
+  BVH_flatNode &n = nodes[flatIndex];
+
+  if (n.isLeaf) {
+    BVH_leaf leaf;
+    leaf.offset = n.offset;
+    leaf.count  = n.count;
+    leaves.add( leaf );
+    stackNeeded = 1;
+    return ~(leaves.size()-1);
+  }
+
+  // Gather the children
+
+  int children[ BVH_WIDTH ];
+  int numChildren = 0;
+
+  for (int i=0; i<n.count && numChildren < BVH_WIDTH; i++)
+    children[numChildren++] = n.offset+i;
+
+  if (n.count > BVH_WIDTH) {
+    cerr << "BVH node has " << n.count << " children, but BVH_WIDTH is only " << BVH_WIDTH << endl;
+    exit(1);
+  }
+
+  while (true) {
+
+    int   bestChild = -1;
+    float bestArea  = -1;
+
+    for (int i=0; i<numChildren; i++) {
+      BVH_flatNode &c = nodes[ children[i] ];
+      if (!c.isLeaf && numChildren-1+c.count <= BVH_WIDTH && c.bbox.surfaceArea() > bestArea) {
+        bestChild = i;
+        bestArea = c.bbox.surfaceArea();
+      }
+    }
+
+    if (bestChild < 0)
+      break;
+
+    BVH_flatNode &c = nodes[ children[bestChild] ];
+    int first = c.offset;
+    int count = c.count;
+
+    children[bestChild] = first;
+    for (int i=1; i<count; i++)
+      children[numChildren++] = first+i;
+  }
+
+  // Build this node (by index, since 'wideNodes' may be reallocated
+  // while the children are built)
+
+  int index = wideNodes.size();
+  wideNodes.add( BVH_wideNode() );
+
+  for (int j=0; j<BVH_WIDTH; j++) {
+    for (int k=0; k<3; k++) {
+      wideNodes[index].bounds[k][j]   =  MAXFLOAT; // empty
+      wideNodes[index].bounds[k+3][j] = -MAXFLOAT;
+    }
+    wideNodes[index].child[j] = 0;
+  }
+
+  // While one child is traversed, up to numChildren-1 others can be
+  // on the stack
+
+  stackNeeded = 0;
+
+  for (int j=0; j<numChildren; j++) {
+
+    int childNeeded;
+    int ref = buildWideSubtree( children[j], childNeeded );
+
+    BBox &b = nodes[ children[j] ].bbox;
+
+    for (int k=0; k<3; k++) {
+      wideNodes[index].bounds[k][j]   = b.min[k];
+      wideNodes[index].bounds[k+3][j] = b.max[k];
+    }
+    wideNodes[index].child[j] = ref;
+
+    stackNeeded = MAX( stackNeeded, childNeeded + numChildren-1 );
+  }
+
+  return index;
+}
+
+
+
+// Store node 'n' at nodes[index].  Its children are added as a block
+// at the end of 'nodes' and then flattened in turn.
+
+void BVH::flattenSubtree( BVH_node *n, int index, seq<BVH_triangle> &orderedTriangles )
+
+{
+  nodes[index].bbox = n->bbox;
+  nodes[index].pad = 0;
+
+  if (n->isLeaf) {
+
+    nodes[index].isLeaf = 1;
+    nodes[index].offset = orderedTriangles.size();
+    nodes[index].count  = n->count;
+
+    for (int i=0; i<n->count; i++)
+      orderedTriangles.add( triangles[ n->triangles[i] ] );
+
+    return;
+  }
+
+  int numChildren = n->count;
+  int firstChild = nodes.size();
+
+  nodes[index].isLeaf = 0;
+  nodes[index].offset = firstChild;
+  nodes[index].count  = numChildren;
+
+  for (int i=0; i<numChildren; i++)
+    nodes.add( BVH_flatNode() );
+
+  for (int i=0; i<numChildren; i++)
+    flattenSubtree( n->children[i], firstChild+i, orderedTriangles );
+}
+
+
 
 // Build the BVH
 //
@@ -24,37 +337,38 @@
 
 
 
-BVH_node * BVH::makeLeafNode( seq<int> &triangleIndices )
+BVH_node * BVH::makeLeafNode( int *triangleIndices, int numTriangles )
 
 {
-  BVH_node *n = new BVH_node();
+  BVH_node *n = arena.alloc<BVH_node>( 1 );
   
   n->isLeaf    = true;
-  n->triangles = new seq<int>( triangleIndices ); // copy constructor
-  n->bbox      = trianglesBBox( triangleIndices );
+  n->count     = numTriangles;
+  n->triangles = triangleIndices; // (this leaf's range of the build's index array)
+  n->bbox      = trianglesBBox( triangleIndices, numTriangles );
     
   return n;
 }
 
 
-BVH_node * BVH::buildSubtree( seq<int> &triangleIndices, int depth )
+BVH_node * BVH::buildSubtree( int *triangleIndices, int numTriangles, int depth )
 
 {
   // Return a leaf node if there are sufficiently few triangles
 
-  if (triangleIndices.size() <= LEAF_COUNT_THRESHOLD)
-    return makeLeafNode( triangleIndices );
+  if (numTriangles <= LEAF_COUNT_THRESHOLD)
+    return makeLeafNode( triangleIndices, numTriangles );
   
   // Find K seed boxes
 
-  int numSeeds = MIN( K, triangleIndices.size() );
+  int numSeeds = MIN( K, numTriangles );
 
-  BBox *seedBoxes = new BBox[numSeeds];
-  int  *seedIndices = new int[numSeeds];
+  BBox *seedBoxes = arena.alloc<BBox>( numSeeds );
+  int  *seedIndices = arena.alloc<int>( numSeeds );
 
   // Get first seed box
 
-  int randIndex = rand() % triangleIndices.size();
+  int randIndex = rand() % numTriangles;
   seedBoxes[0] = triangleBBox( triangleIndices[randIndex] );
   seedIndices[0] = randIndex;
 
@@ -74,7 +388,7 @@ BVH_node * BVH::buildSubtree( seq<int> &triangleIndices, int depth )
       int randIndex;
       bool alreadyExists;
       do {
-	    randIndex = rand() % triangleIndices.size();
+	    randIndex = rand() % numTriangles;
 	    alreadyExists = false;
 	    for (int k=0; k<i; k++)
 	    if (randIndex == seedIndices[k]) {
@@ -110,57 +424,234 @@ BVH_node * BVH::buildSubtree( seq<int> &triangleIndices, int depth )
 
   // Iteratively cluster around each seed
 
-  seq<int> *clusterTriangles;
+  int *cluster = arena.alloc<int>( numTriangles );
 
   // Demonstration code, which assigns each triangle to a RANDOM cluster
 
-  clusterTriangles = new seq<int>[numSeeds];
+  for (int i=0; i<numTriangles; i++) // all triangles
+    cluster[i] = rand() % numSeeds;
 
-  for (int i=0; i<triangleIndices.size(); i++) { // all triangles
-    int j = rand() % numSeeds;
-    clusterTriangles[j].add( triangleIndices[i] );
-  }
+  // Sort the triangles by cluster (keeping their order within each
+  // cluster) so that each cluster is a contiguous range
+
+  int *clusterStart = arena.alloc<int>( numSeeds+1 );
+
+  for (int i=0; i<numTriangles; i++)
+    clusterStart[ cluster[i]+1 ]++;
+
+  for (int j=0; j<numSeeds; j++)
+    clusterStart[j+1] += clusterStart[j];
+
+  int *nextInCluster = arena.alloc<int>( numSeeds );
+
+  for (int j=0; j<numSeeds; j++)
+    nextInCluster[j] = clusterStart[j];
+
+  for (int i=0; i<numTriangles; i++)
+    scratch[ nextInCluster[ cluster[i] ]++ ] = triangleIndices[i];
+
+  memcpy( triangleIndices, scratch, numTriangles * sizeof(int) );
+
+  // Now build the node (recursively building the subtrees)
+
+  BVH_node **children = arena.alloc<BVH_node*>( numSeeds );
+  int numChildren = 0;
+
+  for (int j=0; j<numSeeds; j++)
+    if (clusterStart[j+1] > clusterStart[j])
+      children[numChildren++] = buildSubtree( triangleIndices + clusterStart[j], clusterStart[j+1] - clusterStart[j], depth+1 );
+
+  return makeInteriorNode( children, numChildren );
+}
+
+
+
+// Make a node with the given children and a bbox around all of them
 
-  // Now build the node
+BVH_node * BVH::makeInteriorNode( BVH_node **children, int numChildren )
 
-  BVH_node *n = new BVH_node();
+{
+  BVH_node *n = arena.alloc<BVH_node>( 1 );
   
-  n->isLeaf = false;
+  n->isLeaf   = false;
+  n->count    = numChildren;
+  n->children = children;
+
+  if (numChildren > 0) {
+
+    n->bbox = children[0]->bbox;
+
+    for (int i=1; i<numChildren; i++)
+      n->bbox.expand( children[i]->bbox );
+  }
+
+  return n;
+}
+
+
+
+// Build the BVH with a binned surface area heuristic (SAH).
+//
+// Triangle centroids are sorted into 'numSAHBins' equal-width bins
+// along each axis, and the split between bins with the lowest
+// expected cost
+//
+//    traversalCost + intersectionCost * (A_left N_left + A_right N_right) / A
+//
+// is compared against the cost (intersectionCost * N) of making a
+// leaf.  See Wald, "On fast Construction of SAH-based Bounding Volume
+// Hierarchies" (2007).
+//
+// Upon call, there is guaranteed to be at least one triangle.
+
+BVH_node * BVH::buildSAHSubtree( int *triangleIndices, int numTriangles, int depth )
+
+{
+  int n = numTriangles;
+
+  if (n == 1)
+    return makeLeafNode( triangleIndices, n );
+
+  // Bounds of all triangles and of their centroids
+
+  BBox bbox, centroidBox;
+
+  bbox.makeEmpty();
+  centroidBox.makeEmpty();
+
+  for (int i=0; i<n; i++) {
+    bbox.expand( triBoxes[ triangleIndices[i] ] );
+    centroidBox.expand( triCentroids[ triangleIndices[i] ] );
+  }
 
-  // (recursively build the subtrees)
+  float area = bbox.surfaceArea();
 
-  n->children  = new seq<BVH_node*>();
+  // Find the best split over all axes
 
-  for (int i=0; i<numSeeds; i++)
-    if (clusterTriangles[i].size() > 0)
-      n->children->add( buildSubtree( clusterTriangles[i], depth+1 ) );
+  int   numBins = numSAHBins;
+  int   bestAxis = -1;
+  int   bestSplit = 0;      // left side gets bins [0,bestSplit)
+  float bestCost = MAXFLOAT;
 
-  // (find the bbox around all the subtrees)
+  for (int axis=0; axis<3; axis++) {
 
-  if (n->children->size() > 0) {
+    float cmin = centroidBox.min[axis];
+    float extent = centroidBox.max[axis] - cmin;
 
-    n->bbox = (*n->children)[0]->bbox;
+    if (extent <= 0)
+      continue; // all centroids are in the same plane
 
-    for (int i=1; i<n->children->size(); i++) {
+    float binScale = numBins / extent;
 
-      BBox bbox = (*n->children)[i]->bbox;
+    for (int b=0; b<numBins; b++) {
+      binCount[b] = 0;
+      binBox[b].makeEmpty();
+    }
+
+    for (int i=0; i<n; i++) {
+      int t = triangleIndices[i];
+      int b = MIN( numBins-1, (int) ((triCentroids[t][axis] - cmin) * binScale) );
+      binCount[b]++;
+      binBox[b].expand( triBoxes[t] );
+    }
+
+    // Sweep from the right to get the area and count to the right of each split ...
+
+    BBox box;
+    box.makeEmpty();
+    int count = 0;
+
+    for (int b=numBins-1; b>0; b--) {
+      box.expand( binBox[b] );
+      count += binCount[b];
+      rightArea[b] = box.surfaceArea();
+      rightCount[b] = count;
+    }
 
-      n->bbox.min.x = MIN( n->bbox.min.x, bbox.min.x );
-      n->bbox.min.y = MIN( n->bbox.min.y, bbox.min.y );
-      n->bbox.min.z = MIN( n->bbox.min.z, bbox.min.z );
+    // ... then sweep from the left to evaluate each split
 
-      n->bbox.max.x = MAX( n->bbox.max.x, bbox.max.x );
-      n->bbox.max.y = MAX( n->bbox.max.y, bbox.max.y );
-      n->bbox.max.z = MAX( n->bbox.max.z, bbox.max.z );
+    box.makeEmpty();
+    count = 0;
+
+    for (int b=1; b<numBins; b++) {
+      box.expand( binBox[b-1] );
+      count += binCount[b-1];
+
+      if (count == 0 || rightCount[b] == 0)
+        continue;
+
+      float cost = traversalCost + intersectionCost * (count * box.surfaceArea() + rightCount[b] * rightArea[b]) / area;
+
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestAxis = axis;
+        bestSplit = b;
+      }
     }
   }
 
-  // Done
+  // Make a leaf if that's cheaper than the best split (and allowed)
 
-  delete[] seedBoxes;
-  delete[] seedIndices;
-    
-  return n;
+  if (n <= maxLeafSize && (bestAxis < 0 || intersectionCost * n <= bestCost))
+    return makeLeafNode( triangleIndices, n );
+
+  // Partition the triangles in place, keeping their order on each
+  // side.  The right side is collected in 'scratch' and copied back
+  // after the left.
+
+  int numLeft = n/2; // (if all centroids coincide, so no bin split exists)
+
+  if (bestAxis >= 0) {
+
+    float cmin = centroidBox.min[bestAxis];
+    float binScale = numBins / (centroidBox.max[bestAxis] - cmin);
+
+    int numRight = 0;
+    numLeft = 0;
+
+    for (int i=0; i<n; i++) {
+      int t = triangleIndices[i];
+      int b = MIN( numBins-1, (int) ((triCentroids[t][bestAxis] - cmin) * binScale) );
+      if (b < bestSplit)
+        triangleIndices[numLeft++] = t;
+      else
+        scratch[numRight++] = t;
+    }
+
+    memcpy( triangleIndices + numLeft, scratch, numRight * sizeof(int) );
+  }
+
+  BVH_node **children = arena.alloc<BVH_node*>( 2 );
+
+  children[0] = buildSAHSubtree( triangleIndices, numLeft, depth+1 );
+  children[1] = buildSAHSubtree( triangleIndices + numLeft, n - numLeft, depth+1 );
+
+  return makeInteriorNode( children, 2 );
+}
+
+
+
+// SAH cost of a subtree: each node costs 'traversalCost' and each
+// leaf triangle costs 'intersectionCost', weighted by the probability
+// (surface area relative to the root's) that a ray hits the node.
+
+float BVH::sahCost( BVH_node *n, float rootArea )
+
+{
+  if (rootArea <= 0)
+    return 0;
+
+  float p = n->bbox.surfaceArea() / rootArea;
+
+  if (n->isLeaf)
+    return p * intersectionCost * n->count;
+
+  float cost = p * traversalCost;
+
+  for (int i=0; i<n->count; i++)
+    cost += sahCost( n->children[i], rootArea );
+
+  return cost;
 }
 
 
@@ -185,199 +676,748 @@ BBox BVH::triangleBBox( int triIndex )
   vec3 &v1 = (*vertices)[triangles[triIndex].v1];
   vec3 &v2 = (*vertices)[triangles[triIndex].v2];
 
-  vec3 min( MIN(v0.x,MIN(v1.x,v2.x)),
-	    MIN(v0.y,MIN(v1.y,v2.y)),
-	    MIN(v0.z,MIN(v1.z,v2.z)) );
-
-  vec3 max( MAX(v0.x,MAX(v1.x,v2.x)),
-	    MAX(v0.y,MAX(v1.y,v2.y)),
-	    MAX(v0.z,MAX(v1.z,v2.z)) );
-
-  return BBox(min,max);
+  return BBox( componentMin( v0, componentMin( v1, v2 ) ),
+               componentMax( v0, componentMax( v1, v2 ) ) );
 }
 
 
 
 // Find the bounding box of a SET of triangles
 
-BBox BVH::trianglesBBox( seq<int> &triangleIndices )
+BBox BVH::trianglesBBox( int *triangleIndices, int numTriangles )
 
 {
   BBox bbox = triangleBBox( triangleIndices[0] );
 
-  for (int i=1; i<triangleIndices.size(); i++) {
+  for (int i=1; i<numTriangles; i++)
+    bbox.expand( triangleBBox( triangleIndices[i] ) );
+
+  return bbox;
+}
+
+
+// Is there any triangle between parameters 0 and 'maxParam' along
+// the ray?  This is for shadow rays, so it stops at the first
+// triangle found and computes no shading information.
+
+bool BVH::rayOccluded( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam )
+
+{
+  if (nodes.size() == 0)
+    return false;
+
+  vec3 invDir( 1.0f / rayDir.x, 1.0f / rayDir.y, 1.0f / rayDir.z );
+
+  int nearIndex[3];
+  for (int k=0; k<3; k++)
+    nearIndex[k] = (invDir[k] < 0 ? k+3 : k);
+
+  BVH_stack<int> stackEntries( stackSize );
+  int *stack = stackEntries.entries;
+  int  stackTop = 0;
+
+  float tNear;
+
+  if (!nodes[0].bbox.rayInt( rayStart, invDir, maxParam, tNear ))
+    return false;
+
+  stack[stackTop++] = wideRoot;
+
+  while (stackTop > 0) {
+
+    int ref = stack[--stackTop];
 
-    BBox triBox = triangleBBox( triangleIndices[i] );
+    if (ref < 0) {
 
-    bbox.min.x = MIN( bbox.min.x, triBox.min.x );
-    bbox.min.y = MIN( bbox.min.y, triBox.min.y );
-    bbox.min.z = MIN( bbox.min.z, triBox.min.z );
+      float param = maxParam, alpha, beta;
 
-    bbox.max.x = MAX( bbox.max.x, triBox.max.x );
-    bbox.max.y = MAX( bbox.max.y, triBox.max.y );
-    bbox.max.z = MAX( bbox.max.z, triBox.max.z );
+      if (leafHit( leaves[ ~ref ], rayStart, rayDir, sourceTriangleIndex, param, alpha, beta, true ) >= 0)
+        return true;
+
+    } else {
+
+      BVH_wideNode &n = wideNodes[ref];
+
+      float childT[ BVH_WIDTH ];
+      int mask = wideBoxInt( n, rayStart, invDir, nearIndex, maxParam, childT );
+
+      for (int j=0; j<BVH_WIDTH; j++)
+        if (mask & (1 << j))
+          stack[stackTop++] = n.child[j];
+    }
   }
 
-  return bbox;
+  return false;
 }
 
 
-// Intersect a ray with an axis-aligned bounding box (only the box).
+
+// Slab test of a ray against all children of a wide node.  Bit j of
+// the returned mask is set if the ray hits child j before 'tmax', in
+// which case tNear[j] is the parameter at which the ray enters it.
 //
-// Box is [vmin,vmax].  Ray parameters are restricted to [tmin,tmax].
-// Return true iff ray intersects box (even if starting from the inside).
+// As in BBox::rayInt(), a NaN slab distance (from 0 * Inf) is ignored.
+// The SIMD max and min return their second operand if the first is
+// NaN, which gives the same result as the scalar code.
 
-bool BVH::rayBoxInt( vec3 &rayStart, vec3 &rayDir, float tmin, float tmax, BBox &bbox )
+int BVH::wideBoxInt( BVH_wideNode &n, vec3 &rayStart, vec3 &invDir, int *nearIndex, float tmax, float *tNear )
 
 {
-  for (int i=0; i<3; ++i) {
+#if defined(__AVX__) && BVH_WIDTH == 8
+
+  __m256 tmin8 = _mm256_setzero_ps();
+  __m256 tmax8 = _mm256_set1_ps( tmax );
+
+  for (int k=0; k<3; k++) {
+
+    __m256 org = _mm256_set1_ps( rayStart[k] );
+    __m256 inv = _mm256_set1_ps( invDir[k] );
+
+    __m256 t0 = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( n.bounds[ nearIndex[k] ] ), org ), inv );
+    __m256 t1 = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( n.bounds[ (nearIndex[k]+3) % 6 ] ), org ), inv );
+
+    tmin8 = _mm256_max_ps( t0, tmin8 );
+    tmax8 = _mm256_min_ps( t1, tmax8 );
+  }
+
+  _mm256_storeu_ps( tNear, tmin8 );
 
-    float invD = 1.0f / rayDir[i]; // handles division by zero correctly (i.e. IEEE Inf)
+  return _mm256_movemask_ps( _mm256_cmp_ps( tmin8, tmax8, _CMP_LE_OQ ) );
 
-    float t0 = (bbox.min[i] - rayStart[i]) * invD;
-    float t1 = (bbox.max[i] - rayStart[i]) * invD;
+#elif defined(__SSE2__) && BVH_WIDTH % 4 == 0
 
-    if (invD < 0.0f) {
-      float temp = t1; t1 = t0; t0 = temp;
+  int mask = 0;
+
+  for (int j=0; j<BVH_WIDTH; j+=4) {
+
+    __m128 tmin4 = _mm_setzero_ps();
+    __m128 tmax4 = _mm_set1_ps( tmax );
+
+    for (int k=0; k<3; k++) {
+
+      __m128 org = _mm_set1_ps( rayStart[k] );
+      __m128 inv = _mm_set1_ps( invDir[k] );
+
+      __m128 t0 = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( &n.bounds[ nearIndex[k] ][j] ), org ), inv );
+      __m128 t1 = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( &n.bounds[ (nearIndex[k]+3) % 6 ][j] ), org ), inv );
+
+      tmin4 = _mm_max_ps( t0, tmin4 );
+      tmax4 = _mm_min_ps( t1, tmax4 );
     }
 
-    tmin = (t0 > tmin) ? t0 : tmin; // farthest min distance
-    tmax = (t1 < tmax) ? t1 : tmax; // closest max distance
+    _mm_storeu_ps( &tNear[j], tmin4 );
 
-    if (tmax <= tmin) // crossing outside an edge (or corner)
-       return false;
+    mask |= _mm_movemask_ps( _mm_cmple_ps( tmin4, tmax4 ) ) << j;
   }
 
-  return true;
+  return mask;
+
+#else
+
+  int mask = 0;
+
+  for (int j=0; j<BVH_WIDTH; j++) {
+
+    float tmin = 0;
+    float tmaxj = tmax;
+
+    for (int k=0; k<3; k++) {
+
+      float t0 = (n.bounds[ nearIndex[k] ][j] - rayStart[k]) * invDir[k];
+      float t1 = (n.bounds[ (nearIndex[k]+3) % 6 ][j] - rayStart[k]) * invDir[k];
+
+      tmin  = (t0 > tmin)  ? t0 : tmin;
+      tmaxj = (t1 < tmaxj) ? t1 : tmaxj;
+    }
+
+    tNear[j] = tmin;
+
+    if (tmin <= tmaxj)
+      mask |= (1 << j);
+  }
+
+  return mask;
+
+#endif
+}
+
+
+
+// Test a whole packet against all children of a wide node with
+// interval arithmetic.  The slab distances of the packet's rays lie in
+// intervals computed from the bounds of their starts and inverse
+// directions, so a child is hit by none of them if the intervals
+// don't overlap.  Bit j of the returned mask is clear only if child j
+// can be skipped by all rays.
+//
+// This needs a coherent packet (see RayPacket::setup()).  'tmax' is
+// the largest parameter of any ray's closest hit so far.
+
+int BVH::wideIntervalCull( BVH_wideNode &n, RayPacket &packet, float tmax )
+
+{
+#if defined(__SSE2__) && BVH_WIDTH % 4 == 0
+
+  int mask = 0;
+
+  for (int j=0; j<BVH_WIDTH; j+=4) {
+
+    __m128 tmin4 = _mm_setzero_ps();
+    __m128 tmax4 = _mm_set1_ps( tmax );
+
+    for (int k=0; k<3; k++) {
+
+      int nearPlane = packet.commonNearIndex[k];
+
+      __m128 s0 = _mm_set1_ps( packet.startMin[k] );
+      __m128 s1 = _mm_set1_ps( packet.startMax[k] );
+      __m128 i0 = _mm_set1_ps( packet.invDirMin[k] );
+      __m128 i1 = _mm_set1_ps( packet.invDirMax[k] );
+
+      __m128 bNear = _mm_load_ps( &n.bounds[ nearPlane ][j] );
+      __m128 bFar  = _mm_load_ps( &n.bounds[ (nearPlane+3) % 6 ][j] );
+
+      // Lowest near distance and highest far distance of any ray
+
+      __m128 d0 = _mm_sub_ps( bNear, s0 ), d1 = _mm_sub_ps( bNear, s1 );
+      __m128 t0 = _mm_min_ps( _mm_min_ps( _mm_mul_ps( d0, i0 ), _mm_mul_ps( d0, i1 ) ),
+                              _mm_min_ps( _mm_mul_ps( d1, i0 ), _mm_mul_ps( d1, i1 ) ) );
+
+      d0 = _mm_sub_ps( bFar, s0 );
+      d1 = _mm_sub_ps( bFar, s1 );
+      __m128 t1 = _mm_max_ps( _mm_max_ps( _mm_mul_ps( d0, i0 ), _mm_mul_ps( d0, i1 ) ),
+                              _mm_max_ps( _mm_mul_ps( d1, i0 ), _mm_mul_ps( d1, i1 ) ) );
+
+      tmin4 = _mm_max_ps( t0, tmin4 );
+      tmax4 = _mm_min_ps( t1, tmax4 );
+    }
+
+    mask |= _mm_movemask_ps( _mm_cmple_ps( tmin4, tmax4 ) ) << j;
+  }
+
+  return mask;
+
+#else
+
+  int mask = 0;
+
+  for (int j=0; j<BVH_WIDTH; j++) {
+
+    float tmin = 0;
+    float tmaxj = tmax;
+
+    for (int k=0; k<3; k++) {
+
+      int nearPlane = packet.commonNearIndex[k];
+
+      float d0 = n.bounds[ nearPlane ][j] - packet.startMin[k];
+      float d1 = n.bounds[ nearPlane ][j] - packet.startMax[k];
+      float t0 = MIN( MIN( d0 * packet.invDirMin[k], d0 * packet.invDirMax[k] ),
+                      MIN( d1 * packet.invDirMin[k], d1 * packet.invDirMax[k] ) );
+
+      d0 = n.bounds[ (nearPlane+3) % 6 ][j] - packet.startMin[k];
+      d1 = n.bounds[ (nearPlane+3) % 6 ][j] - packet.startMax[k];
+      float t1 = MAX( MAX( d0 * packet.invDirMin[k], d0 * packet.invDirMax[k] ),
+                      MAX( d1 * packet.invDirMin[k], d1 * packet.invDirMax[k] ) );
+
+      tmin  = (t0 > tmin)  ? t0 : tmin;
+      tmaxj = (t1 < tmaxj) ? t1 : tmaxj;
+    }
+
+    if (tmin <= tmaxj)
+      mask |= (1 << j);
+  }
+
+  return mask;
+
+#endif
 }
 
 
 
+// Draw the BVH down to the depth chosen in the scene
+
+void BVH::renderGL( mat4 &WCS_to_VCS, mat4 &WCS_to_CCS, vec3 lightDir )
+
+{
+  if (nodes.size() > 0)
+    renderSubtreeGL( 0, WCS_to_VCS, WCS_to_CCS, lightDir, scene->bvhDisplayDepth );
+}
+
+
 // Draw a certain number of levels of the BVH.
 
 
-void BVH::renderSubtreeGL( BVH_node *n, mat4 &WCS_to_VCS, mat4 &WCS_to_CCS, vec3 lightDir, int levelsRemaining )
+void BVH::renderSubtreeGL( int nodeIndex, mat4 &WCS_to_VCS, mat4 &WCS_to_CCS, vec3 lightDir, int levelsRemaining )
 
 {
   if (levelsRemaining < 0)
     return;
 
-  if (!n->isLeaf)
-    for (int i=0; i<n->children->size(); i++)
-      renderSubtreeGL( (*n->children)[i], WCS_to_VCS, WCS_to_CCS, lightDir, levelsRemaining-1 );
+  BVH_flatNode &n = nodes[nodeIndex];
+
+  if (!n.isLeaf)
+    for (int i=0; i<n.count; i++)
+      renderSubtreeGL( n.offset+i, WCS_to_VCS, WCS_to_CCS, lightDir, levelsRemaining-1 );
 
   if (levelsRemaining == 0)
-    n->bbox.renderGL( WCS_to_VCS, WCS_to_CCS, lightDir );
+    n.bbox.renderGL( WCS_to_VCS, WCS_to_CCS, lightDir );
 }
 
 
 
-// Compute plane/ray intersection.
+// Find the closest ray/triangle intersection.
 //
 // 'sourceTriangleIndex' is passed in as the triangleIndex of the
 // originating triangle.  Do not check for intersection with this
 // triangle.
+//
+// The flattened tree is traversed with an explicit stack of nodes
+// whose boxes the ray hits, along with the ray parameter at which it
+// enters each box.  A node is skipped if a closer hit than its entry
+// point has been found since it was pushed.
 
 
-bool BVH::rayIntBVH( BVH_node*n, vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, vec3 & intPoint, vec3 & intNormal, vec3 & intTexCoords, float & intParam, Material * &intMaterial, int &intTriangleIndex )
+bool BVH::rayInt( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, vec3 & intPoint, vec3 & intNormal, vec3 & intTexCoords, float & intParam, Material * &intMaterial, int &intTriangleIndex )
 
 {
+  if (nodes.size() == 0)
+    return false;
+
+  // 1/rayDir handles division by zero correctly (i.e. IEEE Inf)
+
+  vec3 invDir( 1.0f / rayDir.x, 1.0f / rayDir.y, 1.0f / rayDir.z );
+
+  // Index in BVH_wideNode::bounds of the near plane on each axis
+
+  int nearIndex[3];
+  for (int k=0; k<3; k++)
+    nearIndex[k] = (invDir[k] < 0 ? k+3 : k);
+
+  BVH_stack<int>   stackRefEntries( stackSize );
+  BVH_stack<float> stackTEntries( stackSize );
+
+  int   *stackRef = stackRefEntries.entries;
+  float *stackT   = stackTEntries.entries;
+  int    stackTop = 0;
+
+  float tNear;
+
+  if (!nodes[0].bbox.rayInt( rayStart, invDir, maxParam, tNear ))
+    return false;
+
+  stackRef[0] = wideRoot;
+  stackT[0] = tNear;
+  stackTop = 1;
+
   bool hit = false;
+  float hitAlpha, hitBeta;
 
-  if (n->isLeaf) { // A leaf, so check all the triangles
+  while (stackTop > 0) {
 
-    for (int i=0; i<n->triangles->size(); i++) {
-      int triangleIndex = (*n->triangles)[i];
-      if (triangleIndex != sourceTriangleIndex) { // this isn't the triangle from which the ray started
+    stackTop--;
 
-	float param, alpha, beta, gamma;
-	vec3 point, normal, texcoords;
+    if (stackT[stackTop] > maxParam)
+      continue; // a closer hit was found after this node was pushed
 
-	if (triangleInt( rayStart, rayDir, triangleIndex, maxParam, param, point, normal, texcoords, alpha, beta, gamma )) { // returns param, point, alpha, beta, gamma
+    int ref = stackRef[stackTop];
 
-	  // found a new closest point
+    if (ref < 0) { // A leaf, so check all the triangles
 
-	  intParam  = param;
-	  intPoint  = point;
-	  intNormal = normal;
-	  intTexCoords = texcoords;
-	  intTriangleIndex = triangleIndex;
-	  intMaterial = materials[ triangles[ (*n->triangles)[i] ].materialID ]; 
+      int triangleIndex = leafHit( leaves[ ~ref ], rayStart, rayDir, sourceTriangleIndex, maxParam, hitAlpha, hitBeta, false );
 
-	  maxParam = param;
-	  hit = true;
-	}
+      if (triangleIndex >= 0) { // found a new closest point (at 'maxParam')
+        intParam = maxParam;
+        intTriangleIndex = triangleIndex;
+        hit = true;
       }
+
+    } else { // Not a leaf, so push the children that the ray hits
+
+      BVH_wideNode &n = wideNodes[ref];
+
+      float childT[ BVH_WIDTH ];
+      int mask = wideBoxInt( n, rayStart, invDir, nearIndex, maxParam, childT );
+
+      // Push far-to-near, so that the nearest child is visited first
+
+      int base = stackTop;
+
+      for (int j=0; j<BVH_WIDTH; j++)
+        if (mask & (1 << j)) {
+          int k = stackTop++;
+          while (k > base && stackT[k-1] < childT[j]) {
+            stackRef[k] = stackRef[k-1];
+            stackT[k] = stackT[k-1];
+            k--;
+          }
+          stackRef[k] = n.child[j];
+          stackT[k] = childT[j];
+        }
     }
+  }
+
+  // Interpolate the shading information only for the closest hit
+
+  if (hit) {
+    intPoint = rayStart + intParam * rayDir;
+    intMaterial = materials[ triangles[intTriangleIndex].materialID ];
+    triangleShading( intTriangleIndex, hitAlpha, hitBeta, intNormal, intTexCoords );
 
     // Note that bump mapping is not implemented yet, but should be
     // done here to return the bump-mapped normal.
+  }
+
+  return hit;
+}
+  
+
+
+// Find the closest triangle hit by each ray of a packet.  This is
+// like calling rayInt() for each ray in 'rayMask' with maxParam =
+// packet.maxParam[r], and returns the mask of rays that hit a
+// triangle closer than that.  See Object::packetRayInt().
+//
+// The packet goes down the wide tree together, with the mask of its
+// rays that hit each node.  Each ray is tested against a node's
+// children as in rayInt(), but only if the interval test of the whole
+// packet doesn't rule out all of them.
+
+unsigned int BVH::packetRayInt( RayPacket &packet, unsigned int rayMask, int sourceTriangleIndex )
+
+{
+  if (nodes.size() == 0)
+    return 0;
+
+  rayMask = packet.boxMask( nodes[0].bbox, rayMask );
 
-  } else { // Not a leaf, so recurse into children
+  if (rayMask == 0)
+    return 0;
 
-    for (int i=0; i<n->children->size(); i++) {
-      BVH_node *thisNode = (*n->children)[i];
-      if (rayBoxInt( rayStart, rayDir, 0, maxParam, thisNode->bbox )) {
-	if (rayIntBVH( thisNode, rayStart, rayDir, sourceTriangleIndex, maxParam, intPoint, intNormal, intTexCoords, intParam, intMaterial, intTriangleIndex )) {
-	  maxParam = intParam;
-	  hit = true;
-	}
+  int          hitTriangle[ MAX_PACKET_SIZE ];
+  float        hitAlpha[ MAX_PACKET_SIZE ], hitBeta[ MAX_PACKET_SIZE ];
+  unsigned int hitMask = 0;
+
+  BVH_stack<int>          stackRefEntries( stackSize );
+  BVH_stack<unsigned int> stackMaskEntries( stackSize );
+  BVH_stack<float>        stackTEntries( stackSize ); // nearest entry of any ray
+
+  int          *stackRef  = stackRefEntries.entries;
+  unsigned int *stackMask = stackMaskEntries.entries;
+  float        *stackT    = stackTEntries.entries;
+  int           stackTop;
+
+  stackRef[0] = wideRoot;
+  stackMask[0] = rayMask;
+  stackT[0] = 0;
+  stackTop = 1;
+
+  while (stackTop > 0) {
+
+    stackTop--;
+
+    int ref = stackRef[stackTop];
+    unsigned int mask = stackMask[stackTop];
+
+    // Drop the rays that have since found a hit closer than this node
+
+    float farthestHit = 0;
+
+    for (int r=0; r<packet.numRays; r++)
+      if (mask & (1u << r)) {
+        if (stackT[stackTop] > packet.maxParam[r])
+          mask &= ~(1u << r);
+        else if (packet.maxParam[r] > farthestHit)
+          farthestHit = packet.maxParam[r];
+      }
+
+    if (mask == 0)
+      continue;
+
+    if (ref < 0) { // A leaf, so check all the triangles for each ray
+
+      BVH_leaf &leaf = leaves[ ~ref ];
+
+      for (int r=0; r<packet.numRays; r++)
+        if (mask & (1u << r)) {
+
+          int triangleIndex = leafHit( leaf, packet.start[r], packet.dir[r], sourceTriangleIndex,
+                                       packet.maxParam[r], hitAlpha[r], hitBeta[r], false );
+
+          if (triangleIndex >= 0) {
+            hitTriangle[r] = triangleIndex;
+            hitMask |= (1u << r);
+          }
+        }
+
+    } else { // Not a leaf, so find the rays that hit each child
+
+      BVH_wideNode &n = wideNodes[ref];
+
+      int childrenHit = (packet.coherent ? wideIntervalCull( n, packet, farthestHit ) : (1 << BVH_WIDTH) - 1);
+
+      if (childrenHit == 0)
+        continue;
+
+      unsigned int childMask[ BVH_WIDTH ];
+      float        childNearest[ BVH_WIDTH ];
+
+      for (int j=0; j<BVH_WIDTH; j++) {
+        childMask[j] = 0;
+        childNearest[j] = MAXFLOAT;
       }
+
+      for (int r=0; r<packet.numRays; r++)
+        if (mask & (1u << r)) {
+
+          float childT[ BVH_WIDTH ];
+          int m = wideBoxInt( n, packet.start[r], packet.invDir[r], packet.nearIndex[r], packet.maxParam[r], childT ) & childrenHit;
+
+          for (int j=0; j<BVH_WIDTH; j++)
+            if (m & (1 << j)) {
+              childMask[j] |= (1u << r);
+              if (childT[j] < childNearest[j])
+                childNearest[j] = childT[j];
+            }
+        }
+
+      // Push far-to-near, as in rayInt()
+
+      int base = stackTop;
+
+      for (int j=0; j<BVH_WIDTH; j++)
+        if (childMask[j] != 0) {
+          int k = stackTop++;
+          while (k > base && stackT[k-1] < childNearest[j]) {
+            stackRef[k] = stackRef[k-1];
+            stackMask[k] = stackMask[k-1];
+            stackT[k] = stackT[k-1];
+            k--;
+          }
+          stackRef[k] = n.child[j];
+          stackMask[k] = childMask[j];
+          stackT[k] = childNearest[j];
+        }
     }
   }
 
-  return hit;
+  // Interpolate the shading information only for the closest hits
+
+  for (int r=0; r<packet.numRays; r++)
+    if (hitMask & (1u << r)) {
+
+      RayHit &h = packet.hits[r];
+
+      h.param = packet.maxParam[r];
+      h.P = packet.start[r] + h.param * packet.dir[r];
+      h.mat = materials[ triangles[ hitTriangle[r] ].materialID ];
+      h.objPartIndex = hitTriangle[r];
+
+      triangleShading( hitTriangle[r], hitAlpha[r], hitBeta[r], h.N, h.T );
+    }
+
+  return hitMask;
 }
-  
 
 
-// Adapted from triangle.cpp for use by BVH
 
-bool BVH::triangleInt( vec3 &rayStart, vec3 &rayDir, int triangleIndex, float maxParam, float &param, vec3 &point, vec3 &normal, vec3 &texCoord, float &alpha, float &beta, float &gamma )
+// Test a ray against the triangles of a leaf, except for triangle
+// 'sourceTriangleIndex'.  This returns the index of the closest
+// triangle hit before 'maxParam', or -1 if there is none.  If one is
+// hit, 'maxParam' is updated to its ray parameter and 'alpha' and
+// 'beta' are its barycentric coordinates, as in triangleHit().
+//
+// If 'anyHit' is true (for shadow rays), the first triangle found to
+// be hit is returned instead of the closest.
+//
+// With SSE, a block of triangles is tested at once.  The tests of a
+// block are the same as the scalar ones (including how NaNs fall
+// through them) and the hits are taken in the same order, so the
+// result is the same as triangleHit() on each triangle in turn.
+
+#if defined(__SSE2__) && BVH_TRI_BLOCK == 4
+
+static inline __m128 dot4( __m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz )
 
 {
-  BVH_triangle &tri = triangles[triangleIndex];
+  return _mm_add_ps( _mm_add_ps( _mm_mul_ps( ax, bx ), _mm_mul_ps( ay, by ) ), _mm_mul_ps( az, bz ) );
+}
 
-  vec3 &v0 = (*vertices)[ tri.v0 ];
-  vec3 &v1 = (*vertices)[ tri.v1 ];
-  vec3 &v2 = (*vertices)[ tri.v2 ];
+static inline void cross4( __m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz, __m128 &cx, __m128 &cy, __m128 &cz )
 
-  vec3 faceNormal = (*facetnorms)[ tri.faceID ];
+{
+  // As in vec3::operator^
+
+  cx = _mm_sub_ps( _mm_mul_ps( ay, bz ), _mm_mul_ps( by, az ) );
+  cy = _mm_xor_ps( _mm_set1_ps( -0.0f ), _mm_sub_ps( _mm_mul_ps( ax, bz ), _mm_mul_ps( bx, az ) ) );
+  cz = _mm_sub_ps( _mm_mul_ps( ax, by ), _mm_mul_ps( bx, ay ) );
+}
+
+#endif
+
+
+int BVH::leafHit( BVH_leaf &leaf, vec3 &rayStart, vec3 &rayDir, int sourceTriangleIndex, float &maxParam, float &alpha, float &beta, bool anyHit )
+
+{
+  int hitIndex = -1;
 
-  // Compute ray/plane intersection
+  for (int i=0; i<leaf.count; i+=BVH_TRI_BLOCK) {
 
-  float dn = rayDir * faceNormal;
+    BVH_triBlock &b = triBlocks[ leaf.block + i / BVH_TRI_BLOCK ];
 
-  if (fabs(dn) < 0.0001) // 'fabs' allows intersection from behind the plane.
-    return false; // ray is parallel to plane.
+    int first = leaf.offset + i; // triangle index of slot 0
+    int numInBlock = MIN( BVH_TRI_BLOCK, leaf.count - i );
+
+#if defined(__SSE2__) && BVH_TRI_BLOCK == 4
+
+    __m128 dx = _mm_set1_ps( rayDir.x );
+    __m128 dy = _mm_set1_ps( rayDir.y );
+    __m128 dz = _mm_set1_ps( rayDir.z );
+
+    __m128 e1x = _mm_load_ps( b.e1[0] ), e1y = _mm_load_ps( b.e1[1] ), e1z = _mm_load_ps( b.e1[2] );
+    __m128 e2x = _mm_load_ps( b.e2[0] ), e2y = _mm_load_ps( b.e2[1] ), e2z = _mm_load_ps( b.e2[2] );
+
+    __m128 px, py, pz;
+    cross4( dx, dy, dz, e2x, e2y, e2z, px, py, pz );
+
+    __m128 det = dot4( e1x, e1y, e1z, px, py, pz );
+    __m128 invDet = _mm_div_ps( _mm_set1_ps( 1 ), det );
+
+    __m128 sx = _mm_sub_ps( _mm_set1_ps( rayStart.x ), _mm_load_ps( b.v0[0] ) );
+    __m128 sy = _mm_sub_ps( _mm_set1_ps( rayStart.y ), _mm_load_ps( b.v0[1] ) );
+    __m128 sz = _mm_sub_ps( _mm_set1_ps( rayStart.z ), _mm_load_ps( b.v0[2] ) );
+
+    __m128 a = _mm_mul_ps( dot4( sx, sy, sz, px, py, pz ), invDet );
+
+    __m128 qx, qy, qz;
+    cross4( sx, sy, sz, e1x, e1y, e1z, qx, qy, qz );
+
+    __m128 bb = _mm_mul_ps( dot4( dx, dy, dz, qx, qy, qz ), invDet );
+    __m128 t  = _mm_mul_ps( dot4( e2x, e2y, e2z, qx, qy, qz ), invDet );
+
+    __m128 zeros = _mm_setzero_ps();
+    __m128 ones  = _mm_set1_ps( 1 );
+
+    __m128 miss = _mm_cmpeq_ps( det, zeros );
+    miss = _mm_or_ps( miss, _mm_cmplt_ps( a, zeros ) );
+    miss = _mm_or_ps( miss, _mm_cmpgt_ps( a, ones ) );
+    miss = _mm_or_ps( miss, _mm_cmplt_ps( bb, zeros ) );
+    miss = _mm_or_ps( miss, _mm_cmpgt_ps( _mm_add_ps( a, bb ), ones ) );
+    miss = _mm_or_ps( miss, _mm_cmplt_ps( t, zeros ) );
+    miss = _mm_or_ps( miss, _mm_cmpge_ps( t, _mm_set1_ps( maxParam ) ) );
+
+    int mask = ~_mm_movemask_ps( miss ) & ((1 << numInBlock) - 1);
+
+    if (sourceTriangleIndex >= first && sourceTriangleIndex < first + numInBlock)
+      mask &= ~(1 << (sourceTriangleIndex - first));
+
+    if (mask == 0)
+      continue;
+
+    float tSlot[4], aSlot[4], bSlot[4];
+
+    _mm_storeu_ps( tSlot, t );
+    _mm_storeu_ps( aSlot, a );
+    _mm_storeu_ps( bSlot, bb );
+
+    for (int j=0; j<numInBlock; j++)
+      if ((mask & (1 << j)) && tSlot[j] < maxParam) {
+        maxParam = tSlot[j];
+        alpha = aSlot[j];
+        beta = bSlot[j];
+        hitIndex = first + j;
+        if (anyHit)
+          return hitIndex;
+      }
+
+#else
+
+    for (int j=0; j<numInBlock; j++)
+      if (first + j != sourceTriangleIndex) { // this isn't the triangle from which the ray started
+
+        float param, a, bb;
+
+        if (triangleHit( rayStart, rayDir, b, j, maxParam, param, a, bb )) {
+          maxParam = param;
+          alpha = a;
+          beta = bb;
+          hitIndex = first + j;
+          if (anyHit)
+            return hitIndex;
+        }
+      }
+
+#endif
+  }
+
+  return hitIndex;
+}
+
+
+
+// Just the ray/triangle test, without the shading information.  This
+// tests the triangle in slot 'slot' of a block, and returns the ray
+// parameter and the barycentric coordinates of v1 ('alpha') and v2
+// ('beta') at the intersection point.
+//
+// This is the Moller-Trumbore test on the precomputed triangle edges.
+// Intersections from behind the triangle are allowed.
+
+bool BVH::triangleHit( vec3 &rayStart, vec3 &rayDir, BVH_triBlock &b, int slot, float maxParam, float &param, float &alpha, float &beta )
+
+{
+  vec3 v0( b.v0[0][slot], b.v0[1][slot], b.v0[2][slot] );
+  vec3 e1( b.e1[0][slot], b.e1[1][slot], b.e1[2][slot] );
+  vec3 e2( b.e2[0][slot], b.e2[1][slot], b.e2[2][slot] );
+
+  vec3 p = rayDir ^ e2;
+  float det = e1 * p;
+
+  if (det == 0)
+    return false; // ray is parallel to plane (or triangle is degenerate)
+
+  float invDet = 1 / det;
+
+  vec3 s = rayStart - v0;
+  float a = (s * p) * invDet;
+
+  if (a < 0 || a > 1)
+    return false; // outside of triangle
+
+  vec3 q = s ^ e1;
+  float bb = (rayDir * q) * invDet;
+
+  if (bb < 0 || a + bb > 1)
+    return false; // outside of triangle
+
+  float t = (e2 * q) * invDet;
 
-  float t = (faceNormal*(v0-rayStart)) / dn;
   if (t < 0)
     return false; // plane is behind starting point
 
   if (t >= maxParam)
     return false; // a closer intersection (at 'maxParam') has already been detected in other code
-  
-  vec3 thisPoint = rayStart + t * rayDir;
 
-  // Compute barycentric coords
+  param = t;
+  alpha = a;
+  beta  = bb;
 
-  float denom = ((v1-v0) ^ (v2-v0)) * faceNormal; // should cache this cross product.
+  return true;
+}
 
-  float thisBeta  = (((v1-v0) ^ (thisPoint - v0)) * faceNormal) / denom; // for v2
-  float thisAlpha = (((thisPoint-v0) ^ (v2 - v0)) * faceNormal) / denom; // for v1
-  float thisGamma = 1 - thisAlpha - thisBeta; // for v0
 
-  if (thisAlpha < 0 || thisBeta < 0 || thisGamma < 0)
-    return false; // outside of triangle
+// Normal and texture coordinates at the point with barycentric
+// coordinates 'alpha' (for v1) and 'beta' (for v2).  Adapted from
+// triangle.cpp for use by BVH.
 
-  // Return intersection info
+void BVH::triangleShading( int triangleIndex, float alpha, float beta, vec3 &normal, vec3 &texCoord )
 
-  param  = t;
-  point  = thisPoint;
-  alpha  = thisAlpha;
-  beta   = thisBeta;
-  gamma  = thisGamma;
+{
+  BVH_triangle &tri = triangles[triangleIndex];
+
+  float gamma = 1 - alpha - beta;
+
+  vec3 faceNormal = (*facetnorms)[ tri.faceID ];
 
   if (!obj->hasVertexNormals)
     
@@ -389,7 +1429,7 @@ bool BVH::triangleInt( vec3 &rayStart, vec3 &rayDir, int triangleIndex, float ma
     vec3 &n1 = (*normals)[ tri.n1 ];
     vec3 &n2 = (*normals)[ tri.n2 ];
 
-    normal = (gamma*n0 + alpha*n1 + beta*n2).normalize();
+    normal = (gamma*n0 + alpha*n1 + beta*n2).fastNormalize();
   }
 
   if (obj->hasVertexTexCoords) {
@@ -400,6 +1440,4 @@ bool BVH::triangleInt( vec3 &rayStart, vec3 &rayDir, int triangleIndex, float ma
 
     texCoord = gamma*t0 + alpha*t1 + beta*t2;
   }
-
-  return true;
 }
@@ -10,7 +10,8 @@
 #include "seq.h"
 #include "material.h"
 #include "bbox.h"
-#include "main.h"
+#include "arena.h"
+#include "rayPacket.h"
 #include "wavefront.h"
 
 
@@ -40,39 +41,174 @@ public:
 
 
 
+// Precomputed ray/triangle test data for BVH_TRI_BLOCK triangles, in
+// the edge form of Moller and Trumbore's algorithm: v0 and the edges
+// v1-v0 and v2-v0.  Each coordinate is a separate array across the
+// triangles, so that all of them can be tested against a ray at once
+// with SIMD instructions.
+//
+// The blocks are in the order of the BVH leaves and each leaf starts
+// a new block, so a leaf's triangles are in adjacent cache lines.
+// Unused slots at the end of a leaf's last block have zero edges,
+// which no ray hits.
+
+#define BVH_TRI_BLOCK 4
+
+class alignas(16) BVH_triBlock {
+
+public:
+  float v0[3][BVH_TRI_BLOCK];	   // x, y, z of each triangle's v0
+  float e1[3][BVH_TRI_BLOCK];	   // v1 - v0
+  float e2[3][BVH_TRI_BLOCK];	   // v2 - v0
+};
+
+
+
 class BVH_node {
 
 public:
 
   BBox bbox;		           // node's bounding box
   bool isLeaf;                     // true iff this is a leaf in the BVH
+  int  count;			   // number of children or triangles
   union {
-    seq<BVH_node*> *children;	   // present only for non-leaves
-    seq<int>       *triangles;     // present only for leaves and contains INDICES of leaf triangles
+    BVH_node **children;	   // present only for non-leaves
+    int       *triangles;          // present only for leaves and contains INDICES of leaf triangles
   };
 };
 
 
 
-class BVH {
+// A node of the flattened BVH.  All nodes are stored in one array in
+// depth-first order, with the children of each node stored next to
+// each other.  Each leaf's triangles are likewise contiguous in
+// BVH::triangles.
+//
+// This is 32 bytes, so a node never straddles a cache line.
 
-  bool rayBoxInt( vec3 &rayStart, vec3 &rayDir, float tmin, float tmax, BBox &bbox );
+class alignas(32) BVH_flatNode {
+
+public:
 
-  void freeTree( BVH_node *n ) {
-    if (!n->isLeaf)
-      for (int i=0; i<n->children->size(); i++)
-	freeTree( (*n->children)[i] );
-    delete n;
+  BBox           bbox;		   // node's bounding box
+  int            offset;	   // leaf: first triangle index; non-leaf: first child index
+  unsigned short count;		   // leaf: number of triangles; non-leaf: number of children
+  unsigned char  isLeaf;
+  unsigned char  pad;
+
+  BVH_flatNode() {
+    bbox.makeEmpty();
+    offset = 0;
+    count = 0;
+    isLeaf = 0;
+    pad = 0;
   }
+};
+
+
+#define BVH_MAX_LEAF_SIZE 65535 // most triangles in a leaf (the range of BVH_flatNode::count)
+
+#define BVH_STACK_SIZE 256 // max nodes pending during traversal, without allocating
 
-  BVH_node *buildSubtree( seq<int> &triangleIndices, int depth );
-  BVH_node *makeLeafNode( seq<int> &triangleIndices );
+
+// A traversal stack with room for 'size' entries.  A tree that needs
+// up to BVH_STACK_SIZE entries (as all but a very unbalanced one does)
+// is traversed with a stack on the thread's stack; a deeper one has
+// its stack allocated.
+
+template <class T> class BVH_stack {
+
+  T  local[ BVH_STACK_SIZE ];
+  T *allocated;
+
+ public:
+
+  T *entries;
+
+  BVH_stack( int size ) {
+    if (size <= BVH_STACK_SIZE) {
+      allocated = NULL;
+      entries = local;
+    } else {
+      allocated = new T[ size ];
+      entries = allocated;
+    }
+  }
+
+  ~BVH_stack() {
+    delete [] allocated;
+  }
+
+  BVH_stack( BVH_stack const& ) = delete;
+  BVH_stack &operator=( BVH_stack const& ) = delete;
+};
+
+
+
+// A node of the wide BVH used for traversal, which has up to
+// BVH_WIDTH children.  The children's boxes are stored as separate
+// arrays of each coordinate so that all of them can be tested against
+// a ray at once with SIMD instructions.
+//
+// A child reference >= 0 is the index of another wide node.  A
+// reference < 0 is ~i for leaf i in BVH::leaves.  Unused child slots
+// have empty boxes (min > max), which no ray hits.
+
+#define BVH_WIDTH 8
+
+class alignas(32) BVH_wideNode {
+
+public:
+
+  float bounds[6][BVH_WIDTH];	   // min x, y, z then max x, y, z of each child
+  int   child[BVH_WIDTH];	   // child references
+};
+
+
+class BVH_leaf {
+
+public:
+
+  int offset;			   // first triangle index
+  int count;			   // number of triangles
+  int block;			   // first block in BVH::triBlocks
+};
+
+
+
+class BVH {
+
+  BVH_node *buildSubtree( int *triangleIndices, int numTriangles, int depth );
+  BVH_node *buildSAHSubtree( int *triangleIndices, int numTriangles, int depth );
+  BVH_node *makeLeafNode( int *triangleIndices, int numTriangles );
+  BVH_node *makeInteriorNode( BVH_node **children, int numChildren );
 
   BBox triangleBBox( int triIndex );
-  BBox trianglesBBox( seq<int> &triangleIndices );
+  BBox trianglesBBox( int *triangleIndices, int numTriangles );
 
   float boxBoxDistance( BBox &b1, BBox &b2 );
 
+  float sahCost( BVH_node *n, float rootArea );
+
+  void flattenTree();
+  void buildWideTree();
+  void buildTriangleBlocks();
+  int  buildWideSubtree( int flatIndex, int &stackNeeded );
+
+  int  wideBoxInt( BVH_wideNode &n, vec3 &rayStart, vec3 &invDir, int *nearIndex, float tmax, float *tNear );
+  int  wideIntervalCull( BVH_wideNode &n, RayPacket &packet, float tmax );
+  void flattenSubtree( BVH_node *n, int index, seq<BVH_triangle> &orderedTriangles );
+
+  Arena arena;                  // storage used during the build (freed after it)
+  int  *scratch;                // for partitioning triangle indices (only during the build)
+  BBox *triBoxes;               // triangle bounding boxes (only during the SAH build)
+  vec3 *triCentroids;           // triangle bbox centres (only during the SAH build)
+
+  int   *binCount;              // SAH bins (only during the SAH build)
+  BBox  *binBox;
+  float *rightArea;
+  int   *rightCount;
+
 public:
 
   wfModel   *obj;
@@ -82,44 +218,51 @@ public:
   seq<vec3> *facetnorms;
   seq<Material*> materials;
   seq<BVH_triangle> triangles;
+  seq<BVH_triBlock> triBlocks;   // test data for the triangles of each leaf
+
+  BVH_node *root;                 // tree as built (in 'arena', so freed once flattened)
+
+  seq<BVH_flatNode> nodes;        // flattened tree; nodes[0] is the root
 
-  BVH_node *root;
+  seq<BVH_wideNode> wideNodes;    // wide tree for traversal
+  seq<BVH_leaf>     leaves;       // leaves of the wide tree
+  int               wideRoot;     // reference to the root of the wide tree
+  int               stackSize;    // traversal stack entries needed for the wide tree
+
+  // Build parameters
+
+  static bool  useSAH;           // binned SAH builder (otherwise k-means clustering)
+  static int   numSAHBins;       // number of bins per axis when evaluating SAH splits
+  static int   maxLeafSize;      // SAH leaves never hold more triangles than this
+  static float traversalCost;    // SAH cost of visiting a node ...
+  static float intersectionCost; // ... relative to this cost of a triangle test
+
+  static double totalBuildTime;  // seconds spent building all BVHs so far
 
   BVH() {
     root = NULL;
+    wideRoot = 0;
+    stackSize = 1;
+    scratch = NULL;
+    triBoxes = NULL;
+    triCentroids = NULL;
+    binCount = rightCount = NULL;
+    binBox = NULL;
+    rightArea = NULL;
   }
 
   ~BVH() {
-    if (root != NULL)
-      freeTree( root );
     // Note that vertices, texcoords, and materials are stored
     // elsewhere and should not be deleted here.
   }
 
-  void buildTree() {
-    // cout << "Building with " << vertices->size() << " vertices, " << texcoords->size() << " texcoords, " << materials.size() << " materials, " << triangles.size() << " triangles." << endl;
-    if (triangles.size() == 0)
-      root = NULL;
-    else {
-      // Create a sequence of all triangle indices
-      seq<int> triangleIndices( triangles.size() );
-      for (int i=0; i<triangles.size(); i++)
-	triangleIndices.add( i );
-      // Build the tree
-      root = buildSubtree( triangleIndices, 0 );
-    }
-  };
+  void buildTree();
   
-  bool rayInt( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, vec3 &intPoint, vec3 &intNormal, vec3 &intTexCoords, float &intParam, Material * &mat, int &intTriangleIndex ) {
-    if (root == NULL)
-      return false;
-    return rayIntBVH( root, rayStart, rayDir, sourceTriangleIndex, maxParam, intPoint, intNormal, intTexCoords, intParam, mat, intTriangleIndex );
-  }
+  bool rayInt( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, vec3 &intPoint, vec3 &intNormal, vec3 &intTexCoords, float &intParam, Material * &mat, int &intTriangleIndex );
+  bool rayOccluded( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam );
+  unsigned int packetRayInt( RayPacket &packet, unsigned int rayMask, int sourceTriangleIndex );
 
-  void renderGL( mat4 &WCS_to_VCS, mat4 &WCS_to_CCS, vec3 lightDir ) {
-    if (root != NULL)
-      renderSubtreeGL( root, WCS_to_VCS, WCS_to_CCS, lightDir, scene->bvhDisplayDepth );
-  }
+  void renderGL( mat4 &WCS_to_VCS, mat4 &WCS_to_CCS, vec3 lightDir );
 
   // Determine the texture colour at a point
 
@@ -131,11 +274,11 @@ public:
       return materials[ triangles[triangleIndex].materialID ]->texture->texel( texCoords.x, texCoords.y, alpha );
   }
 
-  bool rayIntBVH( BVH_node *n, vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, vec3 & intPoint, vec3 & intNormal, vec3 &intTexCoords, float & intParam, Material * &mat, int &intTriangleIndex );
-
-  void renderSubtreeGL( BVH_node *root, mat4 &WCS_to_VCS, mat4 &WCS_to_CCS, vec3 lightDir, int levelsRemaining );
+  void renderSubtreeGL( int nodeIndex, mat4 &WCS_to_VCS, mat4 &WCS_to_CCS, vec3 lightDir, int levelsRemaining );
 
-  bool triangleInt( vec3 &rayStart, vec3 &rayDir, int triangleIndex, float maxParam, float &param, vec3 &point, vec3 &normal, vec3 &texcoords, float &alpha, float &beta, float &gamma );
+  int  leafHit( BVH_leaf &leaf, vec3 &rayStart, vec3 &rayDir, int sourceTriangleIndex, float &maxParam, float &alpha, float &beta, bool anyHit );
+  bool triangleHit( vec3 &rayStart, vec3 &rayDir, BVH_triBlock &b, int slot, float maxParam, float &param, float &alpha, float &beta );
+  void triangleShading( int triangleIndex, float alpha, float beta, vec3 &normal, vec3 &texcoords );
 
 };
 
@@ -0,0 +1,151 @@
+// emitters.cpp
+
+
+#include "headers.h"
+#include "emitters.h"
+#include "triangle.h"
+#include "wavefrontobj.h"
+
+
+// An emitter's power: its intensity summed over the colour channels.
+// Only emitters with positive power are gathered, since the others
+// would never be chosen.
+
+static double emitterPower( vec3 &Ie )
+
+{
+  return Ie.x + Ie.y + Ie.z;
+}
+
+
+// Find all emitting triangles and build the table to choose them
+
+void Emitters::gather( seq<Object*> &objects )
+
+{
+  emitters.clear();
+
+  for (int i=0; i<objects.size(); i++) {
+
+    Triangle *tri = dynamic_cast<Triangle*>( objects[i] );
+
+    if (tri != NULL) {
+      if (emitterPower( tri->mat->Ie ) > 0)
+        add( i, -1, tri->verts[0].position, tri->verts[1].position, tri->verts[2].position, tri->mat->Ie );
+      continue;
+    }
+
+    WavefrontObj *wfObj = dynamic_cast<WavefrontObj*>( objects[i] );
+
+    if (wfObj != NULL) {
+
+      BVH &bvh = wfObj->bvh;
+
+      for (int j=0; j<bvh.triangles.size(); j++) {
+
+        BVH_triangle &t = bvh.triangles[j];
+        Material *mat = bvh.materials[ t.materialID ];
+
+        if (emitterPower( mat->Ie ) > 0)
+          add( i, j, (*bvh.vertices)[t.v0], (*bvh.vertices)[t.v1], (*bvh.vertices)[t.v2], mat->Ie );
+      }
+    }
+  }
+
+  buildAliasTable();
+
+  if (emitters.size() > 0)
+    cout << "Emitters: " << emitters.size() << " emitting triangles" << endl;
+}
+
+
+void Emitters::add( int objIndex, int objPartIndex, vec3 v0, vec3 v1, vec3 v2, vec3 Ie )
+
+{
+  Emitter e;
+
+  e.objIndex = objIndex;
+  e.objPartIndex = objPartIndex;
+  e.v0 = v0;
+  e.e1 = v1 - v0;
+  e.e2 = v2 - v0;
+  e.Ie = Ie;
+
+  emitters.add( e );
+}
+
+
+// Build the alias table with Vose's method.  Emitters are chosen in
+// proportion to their power: in the lighting model of
+// Scene::raytrace(), an emitter contributes the average of its
+// points' contributions, which doesn't depend on its area.
+
+void Emitters::buildAliasTable()
+
+{
+  int n = emitters.size();
+
+  prob.clear();
+  alias.clear();
+  pdf.clear();
+
+  double totalPower = 0;
+
+  for (int i=0; i<n; i++)
+    totalPower += emitterPower( emitters[i].Ie );
+
+  if (totalPower <= 0) {	// (also if there are no emitters)
+    emitters.clear();
+    return;
+  }
+
+  prob.resize( n );
+  alias.resize( n );
+  pdf.resize( n );
+
+  // Scaled so that the average slot has probability 1
+
+  seq<double> scaled( n );
+  seq<int>    small( n ), large( n );
+
+  for (int i=0; i<n; i++) {
+    double power = emitterPower( emitters[i].Ie );
+    pdf[i] = power / totalPower;
+    scaled.add( power * n / totalPower );
+    if (scaled[i] < 1)
+      small.add( i );
+    else
+      large.add( i );
+  }
+
+  // Fill each under-full slot with the remainder of an over-full one
+
+  while (small.size() > 0 && large.size() > 0) {
+
+    int s = small[ small.size()-1 ];
+    int l = large[ large.size()-1 ];
+    small.remove();
+
+    prob[s] = scaled[s];
+    alias[s] = l;
+
+    scaled[l] = (scaled[l] + scaled[s]) - 1;
+
+    if (scaled[l] < 1) {
+      large.remove();
+      small.add( l );
+    }
+  }
+
+  // What remains is full (up to rounding error)
+
+  for (int i=0; i<large.size(); i++) {
+    prob[ large[i] ] = 1;
+    alias[ large[i] ] = large[i];
+  }
+
+  for (int i=0; i<small.size(); i++) {
+    prob[ small[i] ] = 1;
+    alias[ small[i] ] = small[i];
+  }
+}
@@ -0,0 +1,84 @@
+// emitters.h
+//
+// All emitting triangles of the scene, gathered once after the scene
+// is read, with an alias table to choose among them in proportion to
+// their power.
+//
+// Emitters are the scene's loose triangles with an emissive material
+// and the triangles of Wavefront objects whose material (from the
+// .mtl file's Ke) is emissive.
+//
+// Each shading point sends a fixed number of shadow rays to emitters
+// chosen from the table, rather than a fixed number to every emitter,
+// so the cost of lighting doesn't grow with the number of emitters.
+// See Walker, "An Efficient Method for Generating Discrete Random
+// Variables with General Distributions" (1977) and Vose's version of
+// the table construction (1991).
+
+
+#ifndef EMITTERS_H
+#define EMITTERS_H
+
+
+#include "linalg.h"
+#include "seq.h"
+#include "object.h"
+
+
+class Emitter {
+
+ public:
+
+  int  objIndex;		// object that the triangle belongs to
+  int  objPartIndex;		// triangle index within that object (-1 for a loose triangle)
+
+  vec3 v0, e1, e2;		// triangle v0 and edges v1-v0 and v2-v0
+  vec3 Ie;			// emitted intensity
+
+  // Is this the triangle that an intersection with (objIndex,
+  // objPartIndex) would report?
+
+  bool isPart( int obj, int part ) {
+    return obj == objIndex && (objPartIndex < 0 || part == objPartIndex);
+  }
+};
+
+
+class Emitters {
+
+  seq<float> prob;		// probability of taking emitter i from slot i ...
+  seq<int>   alias;		// ... or else taking emitter alias[i]
+  seq<float> pdf;		// probability of choosing each emitter
+
+  void add( int objIndex, int objPartIndex, vec3 v0, vec3 v1, vec3 v2, vec3 Ie );
+  void buildAliasTable();
+
+ public:
+
+  seq<Emitter> emitters;
+
+  void gather( seq<Object*> &objects );
+
+  int size() {
+    return emitters.size();
+  }
+
+  // Choose an emitter with probability proportional to its power,
+  // given 'u' uniform in [0,1).  'p' is returned with the probability
+  // of the choice.
+
+  Emitter &choose( float u, float &p ) {
+    int n = emitters.size();
+    float slot = u * n;
+    int i = (int) slot;
+    if (i >= n)
+      i = n-1;
+    if (slot - i >= prob[i])
+      i = alias[i];
+    p = pdf[i];
+    return emitters[i];
+  }
+};
+
+
+#endif
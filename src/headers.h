@@ -42,8 +42,6 @@ using namespace std;
 
 #include "linalg.h"
 
-#define randIn01() (rand() / (float) RAND_MAX)   // random number in [0,1]
-
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 
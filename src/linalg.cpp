@@ -344,16 +344,54 @@ mat4 operator * ( float k, mat4 const& m )
   return out;
 }
 
+#ifdef LINALG_SSE
+
+// With SSE, m * v is computed as the sum of m's columns weighted by
+// v's components.  The products are added in the same order as in the
+// scalar dot product of each row with v, so the results are the same.
+
+static inline void loadColumns( mat4 const& m, __m128 col[4] )
+
+{
+  for (int i=0; i<4; i++)
+    col[i] = _mm_loadu_ps( &m.rows[i].x );
+
+  _MM_TRANSPOSE4_PS( col[0], col[1], col[2], col[3] );
+}
+
+static inline __m128 mulColumns( __m128 const col[4], __m128 v )
+
+{
+  __m128 r =        _mm_mul_ps( col[0], _mm_shuffle_ps( v, v, _MM_SHUFFLE(0,0,0,0) ) );
+  r = _mm_add_ps( r, _mm_mul_ps( col[1], _mm_shuffle_ps( v, v, _MM_SHUFFLE(1,1,1,1) ) ) );
+  r = _mm_add_ps( r, _mm_mul_ps( col[2], _mm_shuffle_ps( v, v, _MM_SHUFFLE(2,2,2,2) ) ) );
+  r = _mm_add_ps( r, _mm_mul_ps( col[3], _mm_shuffle_ps( v, v, _MM_SHUFFLE(3,3,3,3) ) ) );
+  return r;
+}
+
+#endif
+
+
 vec4 operator * ( mat4 const& m, vec4 const& v )
 
 {
   vec4 out;
 
+#ifdef LINALG_SSE
+
+  __m128 col[4];
+  loadColumns( m, col );
+  _mm_storeu_ps( &out.x, mulColumns( col, _mm_loadu_ps( &v.x ) ) );
+
+#else
+
   out[0] = m.rows[0] * v;
   out[1] = m.rows[1] * v;
   out[2] = m.rows[2] * v;
   out[3] = m.rows[3] * v;
 
+#endif
+
   return out;
 }
 
@@ -362,6 +400,24 @@ mat4 operator * ( mat4 const& m, mat4 const& n )
 {
   mat4 out;
 
+#ifdef LINALG_SSE
+
+  // Row i of the product is the sum of n's rows weighted by row i of
+  // m, added in the same order as the scalar code below
+
+  __m128 nRow[4];
+  for (int k=0; k<4; k++)
+    nRow[k] = _mm_loadu_ps( &n.rows[k].x );
+
+  for (int i=0; i<4; i++) {
+    __m128 sum = _mm_setzero_ps();
+    for (int k=0; k<4; k++)
+      sum = _mm_add_ps( sum, _mm_mul_ps( _mm_set1_ps( m[i][k] ), nRow[k] ) );
+    _mm_storeu_ps( &out.rows[i].x, sum );
+  }
+
+#else
+
   for (int i=0; i<4; i++)
     for (int j=0; j<4; j++) {
 
@@ -373,9 +429,51 @@ mat4 operator * ( mat4 const& m, mat4 const& n )
       out[i][j] = sum;
     }
 
+#endif
+
   return out;
 }
 
+
+// Batched transforms
+
+static void transformVec3s( mat4 const& m, vec3 const *in, vec3 *out, int n, float w )
+
+{
+#ifdef LINALG_SSE
+
+  __m128 col[4];
+  loadColumns( m, col );
+
+  for (int i=0; i<n; i++) {
+    vec4 r;
+    _mm_storeu_ps( &r.x, mulColumns( col, _mm_set_ps( w, in[i].z, in[i].y, in[i].x ) ) );
+    out[i] = r.toVec3();
+  }
+
+#else
+
+  for (int i=0; i<n; i++)
+    out[i] = (m * vec4( in[i], w )).toVec3();
+
+#endif
+}
+
+
+void transformPoints( mat4 const& m, vec3 const *in, vec3 *out, int n )
+
+{
+  transformVec3s( m, in, out, n, 1 );
+}
+
+
+void transformDirections( mat4 const& m, vec3 const *in, vec3 *out, int n )
+
+{
+  transformVec3s( m, in, out, n, 0 );
+}
+
+
 mat4 scale( float x, float y, float z )
 
 {
@@ -12,6 +12,15 @@
   #pragma warning(disable : 4244 4305 4996)
 #endif
 
+// SSE is used for the 4-wide mat4 and vec4 operations and for
+// fastNormalize().  Without it, the same operations are done with
+// scalar code.
+
+#if defined(__SSE2__) || defined(_M_X64)
+  #include <immintrin.h>
+  #define LINALG_SSE
+#endif
+
 
 class mat4;
 class vec4;
@@ -120,6 +129,20 @@ public:
     return vec3( x/len, y/len, z/len );
   }
 
+  // Like normalize(), but with the approximate reciprocal square root
+  // and one Newton-Raphson step, which is accurate to about 23 bits.
+
+  vec3 fastNormalize() const {
+    float len2 = x*x + y*y + z*z;
+#ifdef LINALG_SSE
+    float r = _mm_cvtss_f32( _mm_rsqrt_ss( _mm_set_ss( len2 ) ) );
+    r = r * (1.5f - 0.5f * len2 * r * r);
+#else
+    float r = 1 / sqrtf( len2 );
+#endif
+    return vec3( x*r, y*r, z*r );
+  }
+
   float length() const
     { return sqrt( x*x + y*y + z*z ); }
 
@@ -129,6 +152,10 @@ public:
   float & operator[]( unsigned int index ) {
     return (&x)[index];
   }
+
+  float operator[]( unsigned int index ) const {
+    return (&x)[index];
+  }
   
   float distanceToLine( vec3 lineStart, vec3 lineDir );
 
@@ -144,6 +171,15 @@ mat4 identity4();
 
 vec3 operator * ( float k, vec3 const& p );
 
+// Component-wise minimum and maximum (as in the SSE min and max, the
+// second operand is returned if the first is NaN)
+
+inline vec3 componentMin( vec3 const& a, vec3 const& b )
+  { return vec3( a.x < b.x ? a.x : b.x, a.y < b.y ? a.y : b.y, a.z < b.z ? a.z : b.z ); }
+
+inline vec3 componentMax( vec3 const& a, vec3 const& b )
+  { return vec3( a.x > b.x ? a.x : b.x, a.y > b.y ? a.y : b.y, a.z > b.z ? a.z : b.z ); }
+
 
 // I/O operators
 
@@ -343,6 +379,13 @@ mat4 operator * (       float k, mat4 const& m );
 vec4 operator * ( mat4 const& m, vec4 const& v );
 mat4 operator * ( mat4 const& m, mat4 const& n );
 
+// Batched transforms, which set out[i] = m * in[i], with in[i] extended
+// with w = 1 (points) or w = 0 (directions) and the result converted
+// back with vec4::toVec3().  'in' and 'out' may be the same array.
+
+void transformPoints( mat4 const& m, vec3 const *in, vec3 *out, int n );
+void transformDirections( mat4 const& m, vec3 const *in, vec3 *out, int n );
+
 mat4 identity4();
 
 mat4 scale( float x, float y, float z );
@@ -8,6 +8,16 @@
  * raytracing the current scene, and draws that as soon as it's done.
  * You can move the viewpoint again, or press a button, and it'll
  * start raytracing again from the new position.
+ *
+ * With '-o file.ppm', the program instead runs in batch mode: It
+ * raytraces the scene from the viewpoint in its 'eye' block, writes
+ * the image to file.ppm, and exits.  No window is opened, so this
+ * works without a display.
+ *
+ * With '-B report.json', the program instead benchmarks the scenes
+ * named on the command line (or all of those in worlds/) in the same
+ * way, and writes their timings and ray counts to report.json.  The
+ * model caches are not used while benchmarking.
  */
 
 
@@ -23,8 +33,13 @@
 #include "gpuProgram.h"
 #include "font.h"
 #include "pixelZoom.h"
+#include "bvh.h"
+#include "benchmark.h"
+#include "wavefrontobj.h"
 
 
+#define FRAME_TIME (1/60.0)  // max seconds for the main loop to wait for window events
+
 // window dimensions
 
 int windowWidth  = 800;
@@ -39,10 +54,14 @@ PixelZoom  *pixelZoom;
 GPUProgram *gpuProg;
 
 char *filename[2] = { NULL, NULL }; // from command line
+char *outputFilename = NULL;	    // batch mode: write the RT image here and exit
+char *benchmarkFilename = NULL;	    // benchmark mode: write the report here and exit
+seq<char*> benchmarkScenes;	    // scenes to benchmark (default: all in worlds/)
 
 
 void skipComments( istream &in );
 void parseOptions( int argc, char **argv );
+void readScene();
 
 
 // Error callback
@@ -82,6 +101,26 @@ int main( int argc, char **argv )
     exit(1);
   }
 
+  chdir( ".." );
+
+  // Set up the scene
+
+  scene = new Scene(); // must exist before parseOptions() is called
+  parseOptions( argc, argv );
+
+  // Benchmark and batch modes
+
+  if (benchmarkFilename != NULL) {
+    runBenchmark( benchmarkFilename, benchmarkScenes, windowWidth, windowHeight );
+    return 0;
+  }
+
+  if (outputFilename != NULL) {
+    readScene();
+    scene->renderToFile( outputFilename, windowWidth, windowHeight );
+    return 0;
+  }
+
   // Initialize the window
 
   glfwSetErrorCallback( errorCallback );
@@ -102,8 +141,6 @@ int main( int argc, char **argv )
   glfwWindowHint( GLFW_CONTEXT_VERSION_MINOR, 0 );
 #endif
 
-  chdir( ".." );
-
   window = glfwCreateWindow( windowWidth, windowHeight, "Raytracer", NULL, NULL);
   
   if (!window) {
@@ -126,11 +163,6 @@ int main( int argc, char **argv )
 
   initFont( "data/FreeSans.ttf", 20 );
   
-  // Set up the scene
-
-  scene = new Scene(); // must exist before parseOptions() is called
-  parseOptions( argc, argv );
-
   rtWindow = new RTwindow( 20, 50, 1200, 800, filename[0], scene, window ); // production
 
   // rtWindow = new RTwindow( 20, 50, 240, 160, filename[0], scene, window ); // debugging
@@ -139,38 +171,18 @@ int main( int argc, char **argv )
 
   pixelZoom = new PixelZoom();
   
-  // Read the scene file
-
-  {
-    ifstream in( filename[0] );
-
-    if (!in) {
-      cerr << "Error opening " << filename[0] << ".  Check that it exists and that the permissions are set to allow you to read it." << endl;
-      exit(1);
-    }
+  readScene();
 
-    char *basename = strdup(filename[0]);
-    char *p = strrchr( basename, '/' );
-    if (p != NULL)
-      *p = '\0';
-
-    scene->read( basename, in );
-  }
-
-  // Output the scene if a second filename is present on the command line
-
-  if (filename[1] != NULL) {
-    ofstream out( filename[1] );
-    scene->write( out );
-  }
-
-  // Main loop
+  // Main loop.  The ray tracing is done on the renderer's worker
+  // threads, so this loop only handles events and shows the RT image
+  // as it progresses.  It waits for events for at most a frame so
+  // that the progress is shown even if there are none.
 
   int prevButtonDown = -1;
 
   while (!glfwWindowShouldClose( window )) {
 
-    glfwPollEvents();
+    glfwWaitEventsTimeout( FRAME_TIME );
 
     mat4 WCS_to_VCS = rtWindow->arcball->V;
 
@@ -197,6 +209,8 @@ int main( int argc, char **argv )
 
   // Clean up
 
+  scene->stopRT();
+
   glfwDestroyWindow( window );
   glfwTerminate();
 
@@ -205,22 +219,48 @@ int main( int argc, char **argv )
 
 
 
+// Read the scene file, and output the scene if a second filename is
+// present on the command line
+
+void readScene()
+
+{
+  ifstream in( filename[0] );
+
+  if (!in) {
+    cerr << "Error opening " << filename[0] << ".  Check that it exists and that the permissions are set to allow you to read it." << endl;
+    exit(1);
+  }
+
+  char *basename = strdup(filename[0]);
+  char *p = strrchr( basename, '/' );
+  if (p != NULL)
+    *p = '\0';
+
+  scene->read( basename, in );
+
+  if (filename[1] != NULL) {
+    ofstream out( filename[1] );
+    scene->write( out );
+  }
+}
+
+
+
 // Parse the command-line options
 
 void parseOptions( int argc, char **argv )
 
 {
   int next_fn = 0;
+  seq<char*> filenames;
   
   while (argc > 1) {
     argv++;
     argc--;
     if (argv[0][0] != '-') {
 
-      if (next_fn >= 2)
-	cerr << "Only two filenames allowed on command line" << endl;
-      else
-	filename[ next_fn++ ] = argv[0];
+      filenames.add( argv[0] );
 
     } else switch( argv[0][1] ) {
 
@@ -242,14 +282,117 @@ void parseOptions( int argc, char **argv )
       Texture::useMipMaps = !Texture::useMipMaps;
       break;
 
+    case 'j':			// number of ray tracing threads
+      argc--; argv++;
+      scene->numThreads = MAX( 1, atoi( *argv ) );
+      break;
+
+    case 'r':			// random seed
+      argc--; argv++;
+      scene->randomSeed = atoi( *argv );
+      break;
+
+    case 'b':			// use SAH or k-means clustering BVH builder?
+      BVH::useSAH = !BVH::useSAH;
+      break;
+
+    case 'k':			// number of SAH bins
+      argc--; argv++;
+      BVH::numSAHBins = MAX( 2, atoi( *argv ) );
+      break;
+
+    case 'l':			// max triangles in an SAH leaf
+      argc--; argv++;
+      BVH::maxLeafSize = MIN( BVH_MAX_LEAF_SIZE, MAX( 1, atoi( *argv ) ) );
+      break;
+
+    case 'c':			// BVH traversal cost (relative to a triangle test)
+      argc--; argv++;
+      BVH::traversalCost = atof( *argv );
+      break;
+
+    case 'B':			// benchmark mode: report filename
+      argc--; argv++;
+      benchmarkFilename = *argv;
+      break;
+
+    case 'C':			// use cached Wavefront objects and BVHs?
+      WavefrontObj::useCache = !WavefrontObj::useCache;
+      break;
+
+    case 'o':			// batch mode: output filename
+      argc--; argv++;
+      outputFilename = *argv;
+      break;
+
+    case 'w':			// image width
+      argc--; argv++;
+      windowWidth = MAX( 2, atoi( *argv ) );
+      break;
+
+    case 'h':			// image height
+      argc--; argv++;
+      windowHeight = MAX( 2, atoi( *argv ) );
+      break;
+
+    case 'p':			// primary rays per packet
+      argc--; argv++;
+      scene->packetSize = MAX( 1, MIN( MAX_PACKET_SIZE, atoi( *argv ) ) );
+      break;
+
+    case 'a':			// adaptive sampling target noise
+      argc--; argv++;
+      scene->targetNoise = MAX( 0, atof( *argv ) );
+      break;
+
+    case 'e':			// shadow rays to emitters per shading point
+      argc--; argv++;
+      scene->numEmitterSamples = MAX( 0, atoi( *argv ) );
+      break;
+
+    case 's':			// samples per pixel (-spp), rounded to a square number
+      argc--; argv++;
+      scene->numPixelSamples = MAX( 1, (int) rint( sqrt( atof( *argv ) ) ) );
+      break;
+
     default:
       cerr << "Unrecognized option -" << argv[0][1] << ".  Options are:" << endl;
       cerr << "  -d #   set max depth\n" << endl;
       cerr << "  -t     toggle texture transparency\n" << endl;
+      cerr << "  -j #   set number of ray tracing threads\n" << endl;
+      cerr << "  -r #   set random seed\n" << endl;
+      cerr << "  -b     toggle SAH / k-means clustering BVH builder\n" << endl;
+      cerr << "  -k #   set number of SAH bins\n" << endl;
+      cerr << "  -l #   set max triangles per SAH leaf\n" << endl;
+      cerr << "  -c #   set BVH traversal cost relative to a triangle test\n" << endl;
+      cerr << "  -C     toggle reading/writing the .rtcache file of each Wavefront object\n" << endl;
+      cerr << "  -o f   batch mode: render without a window and write the image to f (a PPM)\n" << endl;
+      cerr << "  -B f   benchmark the scenes given (default: all in worlds/) and write a JSON report to f\n" << endl;
+      cerr << "  -w #   set image width\n" << endl;
+      cerr << "  -h #   set image height\n" << endl;
+      cerr << "  -p #   set number of primary rays traced together as a packet (1 to " << MAX_PACKET_SIZE << ")\n" << endl;
+      cerr << "  -e #   set number of shadow rays sent to emitters from each shading point\n" << endl;
+      cerr << "  -spp # set samples per pixel (rounded to a square number; the max, with adaptive sampling)\n" << endl;
+      cerr << "  -a #   set adaptive sampling's target noise (std error of pixel brightness in [0,1]; 0 = off)\n" << endl;
       break;
     }
   }
 
+  // Filenames are the scene and an optional output scene, or, when
+  // benchmarking, any number of scenes
+
+  if (benchmarkFilename != NULL) {
+    for (int i=0; i<filenames.size(); i++)
+      benchmarkScenes.add( filenames[i] );
+    return;
+  }
+
+  for (int i=0; i<filenames.size(); i++)
+    if (next_fn >= 2)
+      cerr << "Only two filenames allowed on command line" << endl;
+    else
+      filename[ next_fn++ ] = filenames[i];
+
   if (next_fn == 0) {
     cerr << "No input filename provided on command line" << endl;
     abort();
@@ -22,4 +22,7 @@ extern PixelZoom *pixelZoom;
 extern int windowWidth;
 extern int windowHeight;
 
+extern char *filename[2];
+void readScene();
+
 #endif
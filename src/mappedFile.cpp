@@ -0,0 +1,88 @@
+// mappedFile.cpp
+
+
+#include "headers.h"
+#include "mappedFile.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+
+bool MappedFile::open( const char *filename )
+
+{
+  close();
+
+#ifndef _WIN32
+
+  int fd = ::open( filename, O_RDONLY );
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat( fd, &st ) != 0) {
+    ::close( fd );
+    return false;
+  }
+
+  size = st.st_size;
+
+  if (size == 0) {		// mmap() rejects empty files
+    ::close( fd );
+    data = "";
+    return true;
+  }
+
+  void *p = mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  ::close( fd );		// (the mapping stays valid)
+
+  if (p != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+    madvise( p, size, MADV_SEQUENTIAL );
+#endif
+    data = (const char *) p;
+    isMapped = true;
+    return true;
+  }
+
+  // Otherwise fall through to reading the file
+
+#endif
+
+  FILE *file = fopen( filename, "rb" );
+  if (file == NULL)
+    return false;
+
+  fseek( file, 0, SEEK_END );
+  size = ftell( file );
+  fseek( file, 0, SEEK_SET );
+
+  char *buff = new char[ size+1 ];
+  size = fread( buff, 1, size, file );
+  fclose( file );
+
+  data = buff;
+  isMapped = false;
+  return true;
+}
+
+
+void MappedFile::close()
+
+{
+  if (data != NULL && size > 0) {
+#ifndef _WIN32
+    if (isMapped)
+      munmap( (void *) data, size );
+    else
+#endif
+      delete [] data;
+  }
+
+  data = NULL;
+  size = 0;
+  isMapped = false;
+}
@@ -0,0 +1,45 @@
+// mappedFile.h
+//
+// A whole file mapped read-only into memory, so that it can be parsed
+// in place without copying it into buffers.
+//
+// Where mmap() isn't available, the file is read into one buffer
+// instead.
+
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+
+#include <cstddef>
+
+
+class MappedFile {
+
+  bool isMapped;		// data is from mmap() (otherwise from new[])
+
+ public:
+
+  const char *data;		// file contents (NOT null-terminated)
+  size_t      size;		// number of bytes in the file
+
+  MappedFile() {
+    data = NULL;
+    size = 0;
+    isMapped = false;
+  }
+
+  ~MappedFile() {
+    close();
+  }
+
+  bool open( const char *filename ); // returns false if the file cannot be read
+  void close();
+
+  const char *end() {
+    return data + size;
+  }
+};
+
+
+#endif
@@ -8,6 +8,8 @@
 #include "linalg.h"
 #include "material.h"
 #include "gpuProgram.h"
+#include "bbox.h"
+#include "rayPacket.h"
 
 
 class Object {
@@ -21,6 +23,61 @@ class Object {
   virtual bool rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam,
 		       vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, float &intParam, Material * &mat, int &intPartIndex ) = 0;
 
+  // Does the ray hit the object between parameters 0 and 'maxParam'?
+  // This is for shadow rays, which need no shading information, so
+  // objects should override it if they can answer faster than rayInt().
+
+  virtual bool rayOccluded( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam ) {
+    vec3 point, norm, texCoords;
+    float param;
+    Material *m;
+    int partIndex;
+    return rayInt( rayStart, rayDir, objPartIndex, maxParam, point, norm, texCoords, param, m, partIndex );
+  }
+
+  // Intersect the rays of 'packet' that are in 'rayMask' (bit r for
+  // ray r).  Each ray r that hits the object before packet.maxParam[r]
+  // has the hit stored in packet.hits[r] (except for objIndex) and
+  // packet.maxParam[r] set to its parameter.  The mask of those rays
+  // is returned.
+  //
+  // Objects that can do better than testing one ray at a time should
+  // override this.
+
+  virtual unsigned int packetRayInt( RayPacket &packet, unsigned int rayMask, int objPartIndex ) {
+    unsigned int hitMask = 0;
+    for (int r=0; r<packet.numRays; r++)
+      if (rayMask & (1u << r)) {
+        vec3 point, norm, texCoords;
+        float param;
+        Material *m;
+        int partIndex;
+        if (rayInt( packet.start[r], packet.dir[r], objPartIndex, packet.maxParam[r], point, norm, texCoords, param, m, partIndex )) {
+          RayHit &h = packet.hits[r];
+          h.P = point;
+          h.N = norm;
+          h.T = texCoords;
+          h.param = param;
+          h.mat = m;
+          h.objPartIndex = partIndex;
+          packet.maxParam[r] = param;
+          hitMask |= (1u << r);
+        }
+      }
+    return hitMask;
+  }
+
+  // Bounding box, used to build the scene's top-level BVH
+
+  virtual BBox bbox() = 0;
+
+  // A ray leaving a convex object can't hit that object again, so
+  // such an object is not tested for intersection with its own rays
+
+  virtual bool isConvex() {
+    return true;
+  }
+
   virtual vec3 textureColour( vec3 &p, int objPartIndex, float &alpha, vec3 &texCoords ) {
     alpha = 1;
     return vec3(1,1,1);
@@ -0,0 +1,70 @@
+// pixelStats.h
+//
+// Running statistics of the samples of one pixel, for adaptive
+// sampling.
+//
+// The sum of the sample colours gives the pixel's colour.  The running
+// mean and variance of the samples' brightness are kept with Welford's
+// method (see Knuth, TAOCP vol. 2, 4.2.2) and give the standard error
+// of the pixel's brightness, which is used to decide whether the pixel
+// needs more samples.
+//
+// Brightness isn't clamped to [0,1] as it is on the screen: a pixel
+// that sees a small part of a bright emitter has samples that are
+// mostly dim, so its clamped brightness varies little, but its colour
+// depends strongly on how many samples happen to hit the emitter.
+
+
+#ifndef PIXEL_STATS_H
+#define PIXEL_STATS_H
+
+
+#include "linalg.h"
+
+
+class PixelStats {
+
+ public:
+
+  vec3  sum;			// sum of the sample colours
+  int   n;			// number of samples
+  float mean;			// mean of the sample brightnesses
+  float m2;			// sum of squared differences of the brightnesses from the mean
+
+  PixelStats() {
+    clear();
+  }
+
+  void clear() {
+    sum = vec3(0,0,0);
+    n = 0;
+    mean = 0;
+    m2 = 0;
+  }
+
+  void add( vec3 colour ) {
+
+    sum = sum + colour;
+    n++;
+
+    float b = (colour.x + colour.y + colour.z) * (1.0f / 3.0f);
+    float delta = b - mean;
+    mean += delta / n;
+    m2 += delta * (b - mean);
+  }
+
+  vec3 colour() {
+    return (1.0f / (float) n) * sum;
+  }
+
+  // Standard error of the mean brightness
+
+  float stdError() {
+    if (n < 2)
+      return MAXFLOAT;
+    return sqrt( m2 / ((n-1) * (float) n) );
+  }
+};
+
+
+#endif
@@ -0,0 +1,60 @@
+// rayPacket.cpp
+
+
+#include "headers.h"
+#include "rayPacket.h"
+
+
+// Compute the inverse directions and the bounds over the packet, once
+// 'numRays', 'start', and 'dir' are set.  The results are cleared.
+
+void RayPacket::setup()
+
+{
+  coherent = true;
+
+  for (int r=0; r<numRays; r++) {
+
+    // 1/dir handles division by zero correctly (i.e. IEEE Inf)
+
+    invDir[r] = vec3( 1.0f / dir[r].x, 1.0f / dir[r].y, 1.0f / dir[r].z );
+
+    for (int k=0; k<3; k++)
+      nearIndex[r][k] = (invDir[r][k] < 0 ? k+3 : k);
+
+    maxParam[r] = MAXFLOAT;
+
+    if (r == 0) {
+      startMin = startMax = start[0];
+      invDirMin = invDirMax = invDir[0];
+    } else {
+      startMin  = componentMin( start[r], startMin );
+      startMax  = componentMax( start[r], startMax );
+      invDirMin = componentMin( invDir[r], invDirMin );
+      invDirMax = componentMax( invDir[r], invDirMax );
+    }
+
+    for (int k=0; k<3; k++)
+      if (nearIndex[r][k] != nearIndex[0][k] || dir[r][k] == 0 || std::isinf( invDir[r][k] ))
+        coherent = false;
+  }
+
+  for (int k=0; k<3; k++)
+    commonNearIndex[k] = nearIndex[0][k];
+}
+
+
+// The rays of 'rayMask' that hit 'box' before their closest hits so far
+
+unsigned int RayPacket::boxMask( BBox const& box, unsigned int rayMask )
+
+{
+  unsigned int mask = 0;
+  float tNear;
+
+  for (int r=0; r<numRays; r++)
+    if ((rayMask & (1u << r)) && box.rayInt( start[r], invDir[r], maxParam[r], tNear ))
+      mask |= (1u << r);
+
+  return mask;
+}
@@ -0,0 +1,85 @@
+// rayPacket.h
+//
+// A packet of coherent rays (e.g. the primary rays through a small
+// block of pixels) that are traced through the BVHs together.
+//
+// The rays of a packet visit nearly the same nodes, so each node is
+// fetched once for all of them, and a node that none of the rays can
+// hit is rejected with a single interval test over the whole packet
+// (see Wald, Boulos, and Shirley, "Ray Tracing Deformable Scenes
+// using Dynamic Bounding Volume Hierarchies", 2007).
+//
+// Each ray is still tested on its own wherever the packet can't be
+// rejected as a whole, so the hits are those of tracing the rays one
+// at a time.
+
+
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+
+#include "linalg.h"
+#include "bbox.h"
+
+
+#define MAX_PACKET_SIZE 16	// rays in a packet (less than 32, for the ray masks)
+
+
+class Material;
+
+
+// What a ray hits, as returned by Scene::findFirstObjectInt()
+
+class RayHit {
+
+ public:
+
+  vec3      P;			// position
+  vec3      N;			// normal
+  vec3      T;			// texture coordinates
+  float     param;		// ray parameter
+  int       objIndex;		// object hit
+  int       objPartIndex;	// part of that object (e.g. the triangle)
+  Material *mat;		// material at P
+};
+
+
+class RayPacket {
+
+ public:
+
+  int  numRays;
+
+  vec3 start[ MAX_PACKET_SIZE ];
+  vec3 dir[ MAX_PACKET_SIZE ];
+  vec3 invDir[ MAX_PACKET_SIZE ];	// 1/dir
+  int  nearIndex[ MAX_PACKET_SIZE ][3];	// for BVH::wideBoxInt()
+
+  int  thisObjIndex;		// object and part that all rays start from (-1 for primary rays)
+  int  thisObjPartIndex;
+
+  // Results
+
+  float  maxParam[ MAX_PACKET_SIZE ];	// parameter of the closest hit so far (MAXFLOAT if none)
+  RayHit hits[ MAX_PACKET_SIZE ];	// closest hit, if maxParam < MAXFLOAT
+
+  // Bounds over all rays, for interval culling.  These are valid only
+  // if 'coherent' is true, which requires that the directions have
+  // the same signs on each axis (so the same near planes) and no zero
+  // components.
+
+  bool coherent;
+  vec3 startMin, startMax;
+  vec3 invDirMin, invDirMax;
+  int  commonNearIndex[3];	// near planes of all rays in BVH_wideNode::bounds
+
+  unsigned int allRays() {
+    return (1u << numRays) - 1;
+  }
+
+  void setup();
+  unsigned int boxMask( BBox const& box, unsigned int rayMask );
+};
+
+
+#endif
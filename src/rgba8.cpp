@@ -0,0 +1,53 @@
+// rgba8.cpp
+
+
+#include "headers.h"
+#include "rgba8.h"
+
+
+static inline unsigned char toByte( float c )
+
+{
+  return (unsigned char) (255 * MIN( 1, MAX( 0, c ) ) + 0.5);
+}
+
+
+void toRGBA8( vec3 const* colours, RGBA8 *pixels, int n )
+
+{
+  int i = 0;
+
+#ifdef LINALG_SSE
+
+  // Four pixels at a time, with the same arithmetic as toByte().  The
+  // 0.5 is added in double precision, as there: in single precision,
+  // a value just under 0.5 would round up to 1.
+
+  __m128  zeros = _mm_setzero_ps();
+  __m128  ones  = _mm_set1_ps( 1 );
+  __m128  scale = _mm_set1_ps( 255 );
+  __m128d half  = _mm_set1_pd( 0.5 );
+
+  for (; i+4 <= n; i+=4) {
+
+    __m128i c[4];
+
+    for (int j=0; j<4; j++) {
+      vec3 const& col = colours[i+j];
+      __m128 v = _mm_setr_ps( col.x, col.y, col.z, 1 ); // (alpha = 1)
+      v = _mm_mul_ps( _mm_min_ps( ones, _mm_max_ps( zeros, v ) ), scale );
+      __m128i rg = _mm_cvttpd_epi32( _mm_add_pd( _mm_cvtps_pd( v ), half ) );
+      __m128i ba = _mm_cvttpd_epi32( _mm_add_pd( _mm_cvtps_pd( _mm_movehl_ps( v, v ) ), half ) );
+      c[j] = _mm_unpacklo_epi64( rg, ba );
+    }
+
+    __m128i bytes = _mm_packus_epi16( _mm_packs_epi32( c[0], c[1] ), _mm_packs_epi32( c[2], c[3] ) );
+
+    _mm_storeu_si128( (__m128i *) &pixels[i], bytes );
+  }
+
+#endif
+
+  for (; i<n; i++)
+    pixels[i] = RGBA8( toByte( colours[i].x ), toByte( colours[i].y ), toByte( colours[i].z ), 255 );
+}
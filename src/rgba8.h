@@ -0,0 +1,41 @@
+// rgba8.h
+//
+// Pixels of the displayed RT image, with 8 bits per channel.
+//
+// The workers trace colours in floating point and convert them to
+// RGBA8 as they finish them, so the image that is kept, drawn, and
+// sent to the GPU is a quarter of the size of a float RGBA image.
+// Only progressive renders keep float colours, in their accumulation
+// buffer (see TileRenderer).
+//
+// Colours are clamped to [0,1], as they always have been on the screen
+// and in the output PPM.  Alpha is 0 for pixels not yet traced.
+
+
+#ifndef RGBA8_H
+#define RGBA8_H
+
+
+#include "linalg.h"
+
+
+class RGBA8 {
+
+ public:
+
+  unsigned char r, g, b, a;
+
+  RGBA8() {}
+
+  RGBA8( unsigned char _r, unsigned char _g, unsigned char _b, unsigned char _a ) {
+    r = _r; g = _g; b = _b; a = _a;
+  }
+};
+
+
+// Convert n colours to opaque RGBA8 pixels
+
+void toRGBA8( vec3 const* colours, RGBA8 *pixels, int n );
+
+
+#endif
@@ -63,12 +63,14 @@ void RTwindow::keyCallback( GLFWwindow* window, int key, int scancode, int actio
       scene->storedRayColours.clear();
       break;
     case GLFW_KEY_ESCAPE:
-      exit(0);
+      glfwSetWindowShouldClose( window, GL_TRUE ); // main loop stops the RT workers and exits
+      break;
     case 'E':
       scene->outputEye();
       break;
     case '+':
     case '=':
+      scene->stopRT(); // don't change what the RT workers are reading
       scene->maxDepth++;
       viewpointChanged = true;
       redisplay = true;
@@ -76,12 +78,14 @@ void RTwindow::keyCallback( GLFWwindow* window, int key, int scancode, int actio
     case '-':
     case '_':
       if (scene->maxDepth > 1) {
+	scene->stopRT();
 	scene->maxDepth--;
 	viewpointChanged = true;
 	redisplay = true;
       }
       break;
     case 'P':
+      scene->stopRT();
       if (mods & GLFW_MOD_SHIFT)
 	scene->numPixelSamples++;
       else {
@@ -97,6 +101,7 @@ void RTwindow::keyCallback( GLFWwindow* window, int key, int scancode, int actio
       redisplay = true;
       break;
     case 'J':
+      scene->stopRT();
       scene->jitter = !scene->jitter;
       redisplay = true;
       cout << "jittering " << (scene->jitter ? "on" : "off") << endl;
@@ -215,6 +220,8 @@ void RTwindow::mouseClick( vec3 mouse, int button, int keyModifiers )
 
     if (!keyModifiers) {
 
+      scene->stopRT(); // don't trace alongside the RT workers
+
       scene->storedRays.clear();
       scene->storedRayColours.clear();
       scene->storingRays = true;
@@ -229,6 +236,7 @@ void RTwindow::mouseClick( vec3 mouse, int button, int keyModifiers )
       // So other parts of the code can have debugging code based on
       // the status of the 'debug' flag.
 
+      scene->stopRT();
       scene->debugPixel = vec2( mouse.x, windowHeight - mouse.y - 1 );
     }
 
@@ -0,0 +1,72 @@
+// sampler.h
+//
+// Per-sample random number generation for the ray tracer.
+//
+// This is the PCG32 generator from O'Neill, "PCG: A Family of Simple
+// Fast Space-Efficient Statistically Good Algorithms for Random Number
+// Generation".  It has 64 bits of state, so each worker can keep its
+// own on the stack with no locking (unlike rand()).
+//
+// Each pixel sample is given its own Sampler, seeded from the pixel
+// coordinates, the sample index, and a scene-wide seed.  The random
+// numbers used for a sample therefore don't depend on which thread
+// traces it or in what order, so renders are reproducible.
+
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+
+#include <cstdint>
+
+
+class Sampler {
+
+  uint64_t state;
+  uint64_t inc;                 // stream selector (must be odd)
+
+  // SplitMix64 finalizer, used to scramble the seeds
+
+  static uint64_t mix( uint64_t z ) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  void seed( uint64_t initState, uint64_t stream ) {
+    state = 0;
+    inc = (stream << 1) | 1;
+    nextUInt();
+    state += initState;
+    nextUInt();
+  }
+
+ public:
+
+  Sampler() {}			// (unseeded)
+
+  // One independent stream per pixel, and a different starting state
+  // for each sample index in that pixel
+
+  Sampler( int x, int y, int sampleIndex, unsigned int globalSeed ) {
+    uint64_t pixel = ((uint64_t) (uint32_t) y << 32) | (uint32_t) x;
+    seed( mix( mix( sampleIndex ) ^ globalSeed ), mix( pixel ^ ((uint64_t) globalSeed << 17) ) );
+  }
+
+  unsigned int nextUInt() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + inc;
+    uint32_t xorshifted = (uint32_t) (((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t) (old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+  }
+
+  // Random number in [0,1)
+
+  float next01() {
+    return (nextUInt() >> 8) * (1.0f / 16777216.0f);
+  }
+};
+
+
+#endif
@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <chrono>
 #include "scene.h"
 #include "rtWindow.h"
 #include "arcball.h"
@@ -27,15 +28,23 @@
 #endif
 
 
-#define UPDATE_INTERVAL 0.05  // update the screen with each 5% of RT progress
+#define UPLOAD_WITH_PBO true  // send changed tiles of the RT image to the GPU through a pixel buffer object
 
 #define INDENT(n) { for (int i=0; i<(n); i++) cout << " "; }
 
 vec3 backgroundColour(0,0,0);
 vec3 blackColour(0,0,0);
 
-#define NUM_SOFT_SHADOW_RAYS 50 
 #define MAX_NUM_LIGHTS 4
+#define SHADOW_EPSILON 0.0001 // fraction of the distance to an emitter that shadow rays stop short by
+
+
+// 'debug' is per-thread so that tracing the debug pixel on one worker
+// doesn't turn on debugging output in the others
+
+thread_local bool Scene::debug = false;
+
+thread_local RayCounts Scene::threadRayCounts;
 
 
 // Display everything
@@ -63,38 +72,7 @@ bool Scene::findFirstObjectInt( vec3 rayStart, vec3 rayDir, int thisObjIndex, in
   if (storingRays)
     storedRays.add( rayStart );
 
-  bool hit = false;
-
-  float maxParam = MAXFLOAT;
-
-  for (int i=0; i<objects.size(); i++) {
-
-    WavefrontObj* wfo = dynamic_cast<WavefrontObj*>( objects[i] );
-
-     // don't check for int with the originating object for non-wavefront objects (since such objects are convex)
-    
-    if (wfo || i != thisObjIndex) {
-      
-      vec3 point, normal, texcoords;
-      float t;
-      Material *intMat;
-      int intPartIndex;
-
-      if (objects[i]->rayInt( rayStart, rayDir, ((i != thisObjIndex) ? -1 : thisObjPartIndex), maxParam, point, normal, texcoords, t, intMat, intPartIndex )) {
-
-        P = point;
-        N = normal;
-        T = texcoords;
-        param = t;
-        objIndex = i;
-        objPartIndex = intPartIndex;
-        mat = intMat;
-
-        maxParam = t; // In future, don't intersect any farther than this
-        hit = true;
-      }
-    }
-  }
+  bool hit = objectBVH.rayInt( rayStart, rayDir, thisObjIndex, thisObjPartIndex, P, N, T, param, objIndex, objPartIndex, mat );
 
   if (storingRays) {
 
@@ -118,13 +96,38 @@ bool Scene::findFirstObjectInt( vec3 rayStart, vec3 rayDir, int thisObjIndex, in
   return hit;
 }
 
+// Is there an object within distance 'Ldist' of P in direction L?
+// This is for shadow rays, so it doesn't find the closest object.
+// 'objIndex' and 'objPartIndex' are those of the object at P.
+
+bool Scene::isShadowed( vec3 P, vec3 L, float Ldist, int objIndex, int objPartIndex, int lightIndex )
+
+{
+  threadRayCounts.shadow++;
+
+  if (storingRays) { // storing the ray for debugging needs the point hit
+
+    vec3 intP, intN, intTexCoords;
+    float intT;
+    int intObjIndex, intObjPartIndex;
+    Material *intMat;
+
+    bool found = findFirstObjectInt( P, L, objIndex, objPartIndex, intP, intN, intTexCoords, intT, intObjIndex, intObjPartIndex, intMat, lightIndex );
+
+    return (found && intT <= Ldist);
+  }
+
+  return objectBVH.rayOccluded( P, L, objIndex, objPartIndex, Ldist );
+}
+
+
 // Raytrace: This is the main raytracing routine which finds the first
 // object intersected, performs the lighting calculation, and does
 // recursive calls.
 //
 // This returns the colour received on the ray.
 
-vec3 Scene::raytrace( vec3 &rayStart, vec3 &rayDir, int depth, float weight, int thisObjIndex, int thisObjPartIndex )
+vec3 Scene::raytrace( vec3 &rayStart, vec3 &rayDir, int depth, float weight, int thisObjIndex, int thisObjPartIndex, Sampler &sampler )
 
 {
   // Terminate the ray?
@@ -158,7 +161,7 @@ vec3 Scene::raytrace( vec3 &rayStart, vec3 &rayDir, int depth, float weight, int
   float threshold = 0.01;
 
     if (weight < threshold) {
-      if (randIn01() > prob_terminate)
+      if (sampler.next01() > prob_terminate)
         weight_factor = 1 / (1 - prob_terminate);
       // terminate the ray
       else return blackColour;
@@ -168,10 +171,7 @@ vec3 Scene::raytrace( vec3 &rayStart, vec3 &rayDir, int depth, float weight, int
 
   // Find the closest object intersected
 
-  vec3     P, N, texcoords;
-  float    t;
-  int      objIndex, objPartIndex;
-  Material *mat;
+  RayHit h;
 
   // Below, 'rayStart' is the ray staring point
   //        'rayDir' is the direction of the ray
@@ -179,15 +179,39 @@ vec3 Scene::raytrace( vec3 &rayStart, vec3 &rayDir, int depth, float weight, int
   //        'thisObjPartIndex' is the index of the part on the originating object (e.g. the triangle)
   //
   // If a hit is made then at the intersection point:
-  //        'P' is the position
-  //        'N' is the normal
-  //        'texcoords' are the texture coordinates
-  //        't' is the ray parameter at intersection
-  //        'objIndex' is the index of the object that is hit
-  //        'objPartIndex' is the index of the part of object that is hit
-  //        'mat' is the material at the intersection point
+  //        'h.P' is the position
+  //        'h.N' is the normal
+  //        'h.T' are the texture coordinates
+  //        'h.param' is the ray parameter at intersection
+  //        'h.objIndex' is the index of the object that is hit
+  //        'h.objPartIndex' is the index of the part of object that is hit
+  //        'h.mat' is the material at the intersection point
   
-  bool hit = findFirstObjectInt( rayStart, rayDir, thisObjIndex, thisObjPartIndex, P, N, texcoords, t, objIndex, objPartIndex, mat, -1 );
+  if (thisObjIndex < 0)
+    threadRayCounts.primary++;
+  else
+    threadRayCounts.secondary++;
+
+  bool hit = findFirstObjectInt( rayStart, rayDir, thisObjIndex, thisObjPartIndex, h.P, h.N, h.T, h.param, h.objIndex, h.objPartIndex, h.mat, -1 );
+
+  return hitColour( rayDir, hit, h, depth, weight, weight_factor, thisObjIndex, sampler );
+}
+
+
+// The colour received on a ray in direction 'rayDir' that hits 'h'
+// (if 'hit' is true).  This is the lighting calculation of
+// raytrace(), which is separate so that the hits can also come from
+// tracing a packet of primary rays.
+
+vec3 Scene::hitColour( vec3 &rayDir, bool hit, RayHit &h, int depth, float weight, float weight_factor, int thisObjIndex, Sampler &sampler )
+
+{
+  vec3     &P = h.P;
+  vec3     &N = h.N;
+  vec3     &texcoords = h.T;
+  int      objIndex = h.objIndex;
+  int      objPartIndex = h.objPartIndex;
+  Material *mat = h.mat;
 
   // No intersection: Return background colour
 
@@ -223,7 +247,7 @@ vec3 Scene::raytrace( vec3 &rayStart, vec3 &rayDir, int depth, float weight, int
 
   vec3 Iout = mat->Ie + vec3( mat->ka.x * Ia.x, mat->ka.y * Ia.y, mat->ka.z * Ia.z );
 
-  vec3 Iin = weight_factor * raytrace( P, R, depth, weight, objIndex, objPartIndex);
+  vec3 Iin = weight_factor * raytrace( P, R, depth, weight, objIndex, objPartIndex, sampler );
 
   Iout = Iout + calcIout( N, R, E, E, kd, mat->ks, mat->n, Iin );
 
@@ -240,74 +264,57 @@ vec3 Scene::raytrace( vec3 &rayStart, vec3 &rayDir, int depth, float weight, int
       float  Ldist = L.length();
       L = (1.0/Ldist) * L;
 
-      vec3 intP, intN, intTexCoords;
-      float intT;
-      int intObjIndex, intObjPartIndex;
-      Material *intMat;
-
       // Is there an object between P and the light?
-      //
-      // Note that 'intObjIndex' will return with the index of the
-      // object that is hit.  So the hit object is objects[intObjIndex].
-
-      bool found = findFirstObjectInt( P, L, objIndex, objPartIndex, intP, intN, intTexCoords, intT, intObjIndex, intObjPartIndex, intMat, i );
 
-      if (!found || intT > Ldist) { // no object: Add contribution from this light
+      if (!isShadowed( P, L, Ldist, objIndex, objPartIndex, i )) { // no object: Add contribution from this light
         vec3 Lr = (2 * (L * N)) * N - L;
         Iout = Iout + calcIout( N, L, E, Lr, kd, mat->ks, mat->n, light.colour);
       }
     }
   }
 
-  // Add contributions from emitting triangles
+  // Add contributions from emitting triangles.  A fixed number of
+  // points are chosen over all emitters, with each emitter chosen in
+  // proportion to its power, so each contribution is divided by the
+  // probability of its choice.
 
-  for (int i=0; i<objects.size(); i++) {
-    if (i != thisObjIndex) {
-      Triangle* tri = dynamic_cast<Triangle*>( objects[i] );
-      if (tri && tri->mat->Ie.squaredLength() > 0) {
-        vec3 v0 = (tri->verts[0]).position;
-        vec3 v1 = (tri->verts[1]).position;
-        vec3 v2 = (tri->verts[2]).position;
-        
-        // generate many points on the triangle
-        for (int ii = 0; ii < NUM_SOFT_SHADOW_RAYS; ii++){  
-          float alpha = 1.0f;
-          float beta = 1.0f;
-
-          // make sure it's actually on the triangle
-          while (true) {
-            alpha = randIn01();
-            beta = randIn01();
-            if (alpha + beta < 1.0f)
-              break;
-          }
-
-          // get the point
-          vec3 vT = v0 + alpha * (v1 - v0) + beta * (v2 - v0);
-          vec3 Lp = vT - P;
-
-          if (N * Lp > 0.0f) {
-            float Ldist = Lp.length();
-            Lp = Lp.normalize();
-            vec3 intP, intN, intTexCoords;
-            float intT;
-            int intObjIndex, intObjPartIndex;
-            Material* intMat;
-            bool found = findFirstObjectInt(P, Lp, objIndex, objPartIndex, intP, intN, intTexCoords, intT, intObjIndex, intObjPartIndex, intMat,-1);
-
-
-            if (found && (i == intObjIndex )) {
-              vec3 Lr = (2.0f * (Lp * N)) * N - Lp;
-              Iout = Iout + (1.0f / NUM_SOFT_SHADOW_RAYS) * calcIout(N, Lp, E, Lr, kd, mat->ks, mat->n, intMat->Ie);
-            }
-          }
+  if (emitters.size() > 0)
+    for (int ii=0; ii<numEmitterSamples; ii++) {
+
+      float pEmitter;
+      Emitter &e = emitters.choose( sampler.next01(), pEmitter );
 
+      if (e.isPart( thisObjIndex, -1 ) || e.isPart( objIndex, objPartIndex ))
+        continue;
 
+      float alpha = 1.0f;
+      float beta = 1.0f;
+
+      // make sure it's actually on the triangle
+      while (true) {
+        alpha = sampler.next01();
+        beta = sampler.next01();
+        if (alpha + beta < 1.0f)
+          break;
+      }
+
+      // get the point
+      vec3 vT = e.v0 + alpha * e.e1 + beta * e.e2;
+      vec3 Lp = vT - P;
+
+      if (N * Lp > 0.0f) {
+        float Ldist = Lp.length();
+        Lp = Lp.normalize();
+
+        // The emitter is visible if nothing is hit before the
+        // sample point (which is on the emitter itself)
+
+        if (!isShadowed( P, Lp, (1 - SHADOW_EPSILON) * Ldist, objIndex, objPartIndex, -1 )) {
+          vec3 Lr = (2.0f * (Lp * N)) * N - Lp;
+          Iout = Iout + (1.0f / (numEmitterSamples * pEmitter)) * calcIout(N, Lp, E, Lr, kd, mat->ks, mat->n, e.Ie);
         }
-       
       }
     }
-  }
 
   return  Iout;
 }
@@ -365,7 +372,9 @@ vec3 Scene::pixelColour( int x, int y )
 
   vec3 dir = (llCorner + (x+0.5)*right + (y+0.5)*up).normalize();
 
-  result = raytrace( eye->position, dir, 0, 1, -1, -1 );
+  Sampler sampler( x, y, 0, randomSeed );
+
+  result = raytrace( rayOrigin, dir, 0, 1, -1, -1, sampler );
 
 #else
 
@@ -373,29 +382,20 @@ vec3 Scene::pixelColour( int x, int y )
   // Antialias through a pixel using ('numPixelSamples' x 'numPixelSamples')
   // rays.  Use a regular pattern in the subpixel centres if 'jitter'
   // is false; use a jittered patter if 'jitter' is true.
+  //
+  // Each sample has its own Sampler, seeded by pixel and sample
+  // index, so the result doesn't depend on the thread tracing it.
+  //
+  // With adaptive sampling, samples stop once the pixel's noise is
+  // below 'targetNoise'.
 
 
-  vec3 colors = vec3(0.0f, 0.0f, 0.0f);
-  float N = 0.0f;
-  int& nps = numPixelSamples;
-  for (float ii = 0; ii < nps; ii++){
-    for (float jj = 0; jj < nps; jj++) {
-      vec3 dir;
-      if (jitter) {
-        dir = (llCorner + (x + (ii / nps) + randIn01() * (1.0f / nps)) * right
-         + (y + (jj / nps) + randIn01() * (1.0f / nps))* up).normalize();
-      }
-      else {
-        dir = (llCorner + (x + (ii / nps) + (1.0f / (2.0f * nps))) * right
-         + (y + (jj / nps) + (1.0f / (2.0f * nps))) * up).normalize();
-      }
+  PixelStats stats;
 
-      colors = colors + raytrace(eye->position, dir, 0, 1.0f, -1, -1);
-      N = N + 1.0f;
-    }
-  }
+  while (needsMoreSamples( stats ))
+    stats.add( sampleColour( x, y, sampleIndex( stats.n ) ) );
 
-  result = (1.0f / N) *  colors;
+  result = stats.colour();
 
 
 #endif
@@ -413,6 +413,280 @@ vec3 Scene::pixelColour( int x, int y )
 }
 
 
+// Does a pixel need more samples?  It needs numPixelSamples x
+// numPixelSamples of them, or, with adaptive sampling, only enough
+// that the standard error of its brightness is at most 'targetNoise'.
+//
+// At least ADAPTIVE_MIN_SAMPLES are taken so that the error estimate
+// means something, and at least numPixelSamples so that, in the order
+// of setupSampleOrder(), each row and each column of the pixel's grid
+// of samples has been sampled.  Otherwise a thin edge through the
+// pixel could be missed by all samples, which would then agree.
+
+bool Scene::needsMoreSamples( PixelStats &stats )
+
+{
+  if (stats.n >= numPixelSamples * numPixelSamples)
+    return false;
+
+  if (targetNoise <= 0 || stats.n < MAX( ADAPTIVE_MIN_SAMPLES, numPixelSamples ))
+    return true;
+
+  return stats.stdError() > targetNoise;
+}
+
+
+// The sample of a pixel to take k-th.  With adaptive sampling, a pixel
+// might stop after a few samples, so they are taken in an order in
+// which each prefix is spread over the pixel (see setupSampleOrder()).
+
+int Scene::sampleIndex( int k )
+
+{
+  if (targetNoise <= 0)
+    return k;
+
+  return sampleOrder[k];
+}
+
+
+// Order the numPixelSamples x numPixelSamples samples of a pixel for
+// adaptive sampling.  The cells of the enclosing 2^b x 2^b grid are
+// visited in the order of the first 4^b points of the 2D Sobol'
+// sequence, which lie one to a cell.  Each prefix of 2^m of them has
+// one sample in each of 2^m equal rows and in each of 2^m equal
+// columns of the pixel (and in each of its 2^k x 2^k subsquares, if
+// m = 2k), so edges through the pixel are found after a few samples.
+// Cells outside the numPixelSamples x numPixelSamples grid are
+// skipped, so this is exact only if numPixelSamples is a power of 2.
+
+void Scene::setupSampleOrder()
+
+{
+  int nps = numPixelSamples;
+
+  int bits = 0;
+  while ((1 << bits) < nps)
+    bits++;
+
+  sampleOrder.clear();
+
+  for (unsigned int k=0; k < (1u << (2*bits)); k++) {
+
+    // First dimension: bit-reversed k.  Second dimension: k times the
+    // Pascal matrix, mod 2.
+
+    unsigned int x = 0, y = 0, v = 1u << 31;
+
+    for (int b=0; b<2*bits; b++, v ^= v >> 1)
+      if (k & (1u << b)) {
+        x |= 1u << (31-b);
+        y ^= v;
+      }
+
+    int ii = (bits == 0 ? 0 : x >> (32-bits));
+    int jj = (bits == 0 ? 0 : y >> (32-bits));
+
+    if (ii < nps && jj < nps)
+      sampleOrder.add( ii * nps + jj );
+  }
+}
+
+
+// Colour of sample 'sample' of pixel (x,y), traced as a single ray.
+// Sample ii * numPixelSamples + jj is at (ii,jj) in the pixel's grid
+// of samples.
+
+vec3 Scene::sampleColour( int x, int y, int sample )
+
+{
+  int nps = numPixelSamples;
+
+  Sampler sampler( x, y, sample, randomSeed );
+  vec3 dir = sampleDir( x, y, (float) (sample / nps), (float) (sample % nps), sampler );
+
+  return raytrace( rayOrigin, dir, 0, 1.0f, -1, -1, sampler );
+}
+
+
+// Direction of the primary ray for sample (ii,jj) of the
+// numPixelSamples x numPixelSamples samples of pixel (x,y)
+
+vec3 Scene::sampleDir( int x, int y, float ii, float jj, Sampler &sampler )
+
+{
+  int& nps = numPixelSamples;
+
+  if (jitter)
+    return (llCorner + (x + (ii / nps) + sampler.next01() * (1.0f / nps)) * right
+            + (y + (jj / nps) + sampler.next01() * (1.0f / nps))* up).normalize();
+  else
+    return (llCorner + (x + (ii / nps) + (1.0f / (2.0f * nps))) * right
+            + (y + (jj / nps) + (1.0f / (2.0f * nps))) * up).normalize();
+}
+
+
+// Determine the colours of the pixels in x0 <= x < x1, y0 <= y < y1,
+// which are stored row by row in 'colours'.
+//
+// The primary rays of all samples in the block are traced in packets
+// (see sampleColours()).  The colours are the same as from
+// pixelColour(), which is used instead if packets are off or if a ray
+// is being debugged.
+
+void Scene::blockColours( int x0, int y0, int x1, int y1, vec3 *colours )
+
+{
+  int blockWidth = x1 - x0;
+
+  bool hasDebugPixel = (debugPixel.x >= x0 && debugPixel.x < x1 && debugPixel.y >= y0 && debugPixel.y < y1);
+
+  if (packetSize <= 1 || storingRays || hasDebugPixel) {
+    for (int y=y0; y<y1; y++)
+      for (int x=x0; x<x1; x++)
+        colours[ (x-x0) + (y-y0) * blockWidth ] = pixelColour( x, y );
+    return;
+  }
+
+  int numPixels = blockWidth * (y1 - y0);
+
+  PixelStats stats[ PIXEL_BLOCK_SIZE * PIXEL_BLOCK_SIZE ]; // (blocks are no larger)
+
+  int  xs[ MAX_PACKET_SIZE ], ys[ MAX_PACKET_SIZE ], samples[ MAX_PACKET_SIZE ];
+  int  pixelOf[ MAX_PACKET_SIZE ];
+  vec3 sampleCols[ MAX_PACKET_SIZE ];
+  int  n = 0;
+
+  // Trace the queued samples and add them to their pixels
+
+  auto traceQueued = [&]() {
+    sampleColours( n, xs, ys, samples, sampleCols );
+    for (int r=0; r<n; r++)
+      stats[ pixelOf[r] ].add( sampleCols[r] );
+    n = 0;
+  };
+
+  // Samples are taken in rounds over the pixels that need more.  The
+  // first round takes all of a pixel's samples or, with adaptive
+  // sampling, the minimum number.  Later rounds take one more sample
+  // of each pixel that is still too noisy.  The samples of each pixel
+  // are added in order, so the sums are the same as in pixelColour().
+
+  int samplesPerRound = (targetNoise > 0 ? MAX( ADAPTIVE_MIN_SAMPLES, numPixelSamples ) : numPixelSamples * numPixelSamples);
+
+  while (true) {
+
+    bool tracedAny = false;
+
+    for (int i=0; i<numPixels; i++) {
+
+      if (!needsMoreSamples( stats[i] ))
+        continue;
+
+      int first = stats[i].n;
+      int last  = MIN( first + samplesPerRound, numPixelSamples * numPixelSamples );
+
+      for (int k=first; k<last; k++) {
+        xs[n] = x0 + i % blockWidth;
+        ys[n] = y0 + i / blockWidth;
+        samples[n] = sampleIndex( k );
+        pixelOf[n] = i;
+        if (++n == MAX_PACKET_SIZE)
+          traceQueued();
+      }
+
+      tracedAny = true;
+    }
+
+    if (n > 0)
+      traceQueued();
+
+    if (!tracedAny)
+      break;
+
+    samplesPerRound = 1;
+  }
+
+  for (int i=0; i<numPixels; i++)
+    colours[i] = stats[i].colour();
+}
+
+
+// Determine the colours of sample samples[r] of pixel (xs[r],ys[r]),
+// for 0 <= r < n, which are stored in colours[r].
+//
+// The primary rays are traced in packets of 'packetSize' rays, and
+// then each ray is continued on its own from its hit.  The colours are
+// the same as from sampleColour().  If a ray is being debugged, the
+// first sample of the debug pixel is traced on its own with debugging
+// on.
+
+void Scene::sampleColours( int n, int *xs, int *ys, int *samples, vec3 *colours )
+
+{
+  if (packetSize <= 1 || storingRays) {
+    for (int r=0; r<n; r++)
+      colours[r] = sampleColour( xs[r], ys[r], samples[r] );
+    return;
+  }
+
+  int nps = numPixelSamples;
+  int size = MIN( packetSize, MAX_PACKET_SIZE );
+
+  RayPacket packet;
+  Sampler   samplers[ MAX_PACKET_SIZE ];
+  int       rayOf[ MAX_PACKET_SIZE ];
+
+  packet.thisObjIndex = -1;
+  packet.thisObjPartIndex = -1;
+
+  for (int first=0; first<n; first+=size) {
+
+    packet.numRays = 0;
+
+    for (int r=first; r<MIN( first+size, n ); r++) {
+
+      int x = xs[r];
+      int y = ys[r];
+
+      if (x == debugPixel.x && y == debugPixel.y && samples[r] == 0) {
+        debug = true;
+        cout << "---------------- start debugging at pixel " << debugPixel << " ----------------" << endl;
+        colours[r] = sampleColour( x, y, 0 );
+        cout << "---------------- stop debugging ----------------" << endl;
+        debug = false;
+        continue;
+      }
+
+      int i = packet.numRays++;
+
+      samplers[i] = Sampler( x, y, samples[r], randomSeed );
+
+      packet.start[i] = rayOrigin;
+      packet.dir[i] = sampleDir( x, y, (float) (samples[r] / nps), (float) (samples[r] % nps), samplers[i] );
+      rayOf[i] = r;
+    }
+
+    if (packet.numRays == 0)
+      continue;
+
+    packet.setup();
+
+    unsigned int hitMask = objectBVH.packetRayInt( packet );
+
+    // Continue from each hit as raytrace() would.  (Russian roulette
+    // never stops a primary ray, which has weight 1.)
+
+    for (int i=0; i<packet.numRays; i++) {
+
+      threadRayCounts.primary++;
+
+      colours[ rayOf[i] ] = hitColour( packet.dir[i], (hitMask & (1u << i)) != 0, packet.hits[i], 0, 1.0f, 1, -1, samplers[i] );
+    }
+  }
+}
+
+
 // Read the scene from an input stream
 
 void Scene::read( const char *basename, istream &in )
@@ -476,8 +750,10 @@ void Scene::read( const char *basename, istream &in )
       eye = new Eye();
       in >> *eye;
 
-      win->arcball->setV( eye->position, eye->lookAt, eye->upDir );
-      win->fovy = eye->fovy;
+      if (win != NULL) { // (no window in batch mode)
+        win->arcball->setV( eye->position, eye->lookAt, eye->upDir );
+        win->fovy = eye->fovy;
+      }
       
     } else {
       
@@ -486,8 +762,12 @@ void Scene::read( const char *basename, istream &in )
     }
   }
 
-  if (lights.size() == 0) {
-    cerr << "No lights were provided in " << basename << " so the scene would be black." << endl;
+  objectBVH.build( objects );
+
+  emitters.gather( objects );
+
+  if (lights.size() == 0 && emitters.size() == 0) {
+    cerr << "No lights or emissive surfaces were provided in " << basename << " so the scene would be black." << endl;
     exit(1);
   }
 }
@@ -525,16 +805,21 @@ char *Scene::statusMessage()
 
 
 
-// Draw the scene.  This sets things up and simply
-// calls pixelColour() for each pixel.
+// Draw the scene.  This sets things up and starts the TileRenderer,
+// which traces the pixels progressively on its worker threads.  Later
+// calls update the screen if more tiles have been finished, so the
+// screen always shows the best image so far.  A restart (e.g. from
+// moving the arcball) starts again with the cheap first pass.
+//
+// This is called once per frame by the GL thread and never waits for
+// the workers, so the window stays responsive during a long render.
+// A restart asks the workers to stop and returns; the new render is
+// started by a later call, once they have.
 
 
 void Scene::renderRT( bool restart )
 
 {
-  static float nextDot;
-  static int nextx, nexty;
-
   mat4 WCS_to_VCS = win->arcball->V;
 
   mat4 VCS_to_CCS = perspective( win->fovy, 
@@ -542,6 +827,21 @@ void Scene::renderRT( bool restart )
 				 1, 1000 );
 
   if (restart) {
+    renderer->requestCancel();
+    restartPending = true;
+    stop = false;
+  }
+
+  if (restartPending) {
+
+    // Wait for the workers to stop before changing anything they use
+
+    if (!renderer->idle())
+      return;
+
+    renderer->cancel(); // (only joins the stopped workers)
+
+    restartPending = false;
 
     // Copy the window eye into the scene eye
 
@@ -550,79 +850,207 @@ void Scene::renderRT( bool restart )
     eye->upDir = win->arcball->upDirection();
     eye->fovy = win->fovy;
 
-    vec3 rightDir = ((eye->lookAt - eye->position) ^ eye->upDir).normalize();
+    setupCamera( windowWidth, windowHeight );
 
-    // Compute the image plane coordinate system
+    progressShown = 0;
 
-    up = (2.0 * tan( eye->fovy / 2.0 )) * eye->upDir.normalize();
+    startRT( windowWidth, windowHeight, true );
+  }
 
-    right = (2.0 * tan( eye->fovy / 2.0 ) * windowWidth / (float) windowHeight) * rightDir.normalize();
+  if (stop || rtImage == NULL)
+    return;
 
-    llCorner = (eye->lookAt - eye->position).normalize() - 0.5 * up - 0.5 * right;
+  // Show any newly finished tiles
 
-    up = (1.0 / (float) (windowHeight-1)) * up;
-    right = (1.0 / (float) (windowWidth-1)) * right;
+  if (renderer->finished()) {
 
-    if (nextDot != 0) {
-      cout << "\r           \r";
-      cout.flush();
-    }
+    renderer->cancel(); // (only joins the finished workers)
 
-    nextx = 0;
-    nexty = 0;
-    nextDot = UPDATE_INTERVAL;
+    draw_RT_and_GL( WCS_to_VCS, VCS_to_CCS );
 
-    stop = false;
+    stop = true;
 
-    // Clear the RT image
-    
-    if (rtImage != NULL)
+  } else if (renderer->progress() != progressShown) {
+
+    progressShown = renderer->progress();
+
+    draw_RT_and_GL( WCS_to_VCS, VCS_to_CCS );
+  }
+}
+
+
+// Set up the image plane for a width x height image seen from 'eye'
+
+void Scene::setupCamera( int width, int height )
+
+{
+  vec3 rightDir = ((eye->lookAt - eye->position) ^ eye->upDir).normalize();
+
+  // Compute the image plane coordinate system
+
+  up = (2.0 * tan( eye->fovy / 2.0 )) * eye->upDir.normalize();
+
+  right = (2.0 * tan( eye->fovy / 2.0 ) * width / (float) height) * rightDir.normalize();
+
+  llCorner = (eye->lookAt - eye->position).normalize() - 0.5 * up - 0.5 * right;
+
+  up = (1.0 / (float) (height-1)) * up;
+  right = (1.0 / (float) (width-1)) * right;
+
+  rayOrigin = eye->position;
+}
+
+
+// Set up a new, transparent RT image and start the workers tracing
+// it, either progressively or in a single full-quality pass
+
+void Scene::startRT( int width, int height, bool progressive )
+
+{
+  if (rtImage == NULL || width != rtImageWidth || height != rtImageHeight) {
+
+    if (rtImage != NULL) {
       delete [] rtImage;
+      delete [] rtDisplayImage;
+    }
 
-    rtImage = NULL;
+    rtImageWidth = width;
+    rtImageHeight = height;
+
+    rtImage = new RGBA8[ rtImageWidth * rtImageHeight ];
+    rtDisplayImage = new RGBA8[ rtImageWidth * rtImageHeight ];
   }
 
-  // Set up a new RT image
+  for (int i=0; i<rtImageWidth * rtImageHeight; i++)
+    rtImage[i] = RGBA8(0,0,0,0); // transparent
+
+  setupSampleOrder();
+
+  renderer->start( rtImage, rtImageWidth, rtImageHeight, numThreads, progressive );
+}
+
+
+// Ray trace a width x height image from the scene's eye and write it
+// to a file.  This is the batch mode, which needs no window.
+
+void Scene::renderToFile( const char *filename, int width, int height )
 
-  if (rtImage == NULL) {
-    rtImage = new vec4[ (int) (windowWidth * windowHeight) ];
-    for (int i=0; i<windowWidth * windowHeight; i++)
-      rtImage[i] = vec4(0,0,0,0); // transparent
+{
+  if (eye == NULL) {
+    cerr << "No eye was provided in the scene, so it cannot be rendered." << endl;
+    exit(1);
   }
 
-  if (stop)
-    return;
+  // Make the up direction perpendicular to the view direction, as the
+  // arcball does in the interactive mode
 
-  // Draw the next pixel
+  vec3 z = (eye->position - eye->lookAt).normalize();
+  vec3 x = (eye->upDir ^ z).normalize();
+  eye->upDir = (z ^ x).normalize();
 
-  vec3 colour = pixelColour( nextx, nexty );
+  float renderTime = renderImage( width, height );
 
-  rtImage[ nextx + nexty * (int) windowWidth ] = vec4( colour.x, colour.y, colour.z, 1 ); // opaque
+  cout << "\r" << width << " x " << height << " image with " << (targetNoise > 0 ? "up to " : "")
+       << numPixelSamples * numPixelSamples << " samples per pixel on " << numThreads << " threads in " << renderTime << " seconds" << endl;
 
-  // Move (nextx,nexty) to the next pixel
+  writeRTImage( filename );
+}
 
-  nexty++;
-  if (nexty >= windowHeight) {
-    nexty = 0;
-    nextx++;
-    if ((float)nextx/(float)windowWidth >= nextDot) {
 
-      nextDot += UPDATE_INTERVAL;
+// Ray trace a width x height image from the scene's eye, waiting for
+// it to finish.  Returns the time taken, in seconds.
 
-      draw_RT_and_GL( WCS_to_VCS, VCS_to_CCS );
+float Scene::renderImage( int width, int height )
 
-    }
-    
-    if (nextx >= windowWidth) { // finished
+{
+  setupCamera( width, height );
 
-      draw_RT_and_GL( WCS_to_VCS, VCS_to_CCS );
+  auto startTime = std::chrono::steady_clock::now();
 
-      nextx = 0;
-      stop = true;
-      cout << "\r           \r";
+  startRT( width, height, false );
+
+  int percentShown = -1;
+
+  while (!renderer->finished()) {
+
+    renderer->waitForTiles( 1 );
+
+    int percent = (int) (100 * renderer->progress());
+    if (percent != percentShown) {
+      cout << "\r" << percent << "%";
       cout.flush();
+      percentShown = percent;
+    }
+  }
+
+  renderer->cancel(); // (only joins the finished workers)
+
+  return std::chrono::duration<float>( std::chrono::steady_clock::now() - startTime ).count();
+}
+
+
+// Add this thread's ray counts to the scene's.  The workers count
+// rays in thread-local counters and call this after each tile, so
+// that they don't contend for the counters on every ray.
+
+void Scene::addThreadRayCounts()
+
+{
+  std::lock_guard<std::mutex> lock( rayCountsLock );
+
+  rayCounts.primary   += threadRayCounts.primary;
+  rayCounts.secondary += threadRayCounts.secondary;
+  rayCounts.shadow    += threadRayCounts.shadow;
+
+  threadRayCounts = RayCounts();
+}
+
+
+// Write the RT image to a PPM file.  Its colours are already clamped
+// and converted to 8 bits (see rgba8.h).
+
+void Scene::writeRTImage( const char *filename )
+
+{
+  FILE *f = fopen( filename, "wb" );
+
+  if (f == NULL) {
+    cerr << "Error opening " << filename << " for writing." << endl;
+    exit(1);
+  }
+
+  fprintf( f, "P6\n%d %d\n255\n", rtImageWidth, rtImageHeight );
+
+  unsigned char *row = new unsigned char[ 3 * rtImageWidth ];
+
+  for (int y=rtImageHeight-1; y>=0; y--) { // PPM rows are top to bottom
+
+    for (int x=0; x<rtImageWidth; x++) {
+      RGBA8 &c = rtImage[ x + y * rtImageWidth ];
+      row[3*x+0] = c.r;
+      row[3*x+1] = c.g;
+      row[3*x+2] = c.b;
     }
+
+    fwrite( row, 3, rtImageWidth, f );
   }
+
+  delete [] row;
+  fclose( f );
+}
+
+
+// Stop ray tracing.  This is needed before tracing on the GL thread
+// (e.g. to store the rays of one pixel) or changing a setting that the
+// workers read (e.g. numPixelSamples) so as not to race with the
+// workers.  A restart doesn't wait for them to stop.
+
+void Scene::stopRT()
+
+{
+  renderer->cancel();
+  restartPending = false;
+  stop = true;
 }
 
 
@@ -643,6 +1071,11 @@ void Scene::renderGL( mat4 &WCS_to_VCS, mat4 &VCS_to_CCS )
   if (segs == NULL)
     segs = new Segs();
 
+  if (wavefrontGPU == NULL) {
+    wavefrontGPU = new GPUProgram();
+    wavefrontGPU->init( wavefrontVertexShader, wavefrontFragmentShader, "in Scene::renderGL()" );
+  }
+
   vec3 lightDir = vec3(1,1,1).normalize();
   
   // Set up the framebuffer
@@ -809,6 +1242,10 @@ void Scene::draw_RT_and_GL( mat4 &WCS_to_VCS, mat4 &VCS_to_CCS )
 
 
 
+// Draw the RT image on a full-screen quad.  The texture and the quad
+// are made once.  After that, only the tiles that have changed since
+// the last call are sent to the GPU, unless the image size changed.
+
 void Scene::drawRTImage()
 
 {
@@ -828,33 +1265,51 @@ void Scene::drawRTImage()
   glActiveTexture( GL_TEXTURE1 );
   glBindTexture( GL_TEXTURE_2D, rtImageTexID );
 
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+  seq<Tile> dirtyTiles;
+  renderer->takeDirtyTiles( dirtyTiles, rtDisplayImage );
 
-  glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, windowWidth, windowHeight, 0, GL_RGBA, GL_FLOAT, rtImage );
+  if (rtImageWidth != rtTexWidth || rtImageHeight != rtTexHeight) {
 
-  // Draw texture on a full-screen quad
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
 
-  vec2 verts[8] = {
-    vec2( -1, -1 ), vec2( -1, 1 ), vec2( 1, -1 ), vec2( 1, 1 ), // positions
-    vec2(  0,  0 ), vec2(  0, 1 ), vec2( 1,  0 ), vec2( 1, 1 )  // texture coordinates
-  };
-    
-  GLuint VAO, VBO;
+    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA8, rtImageWidth, rtImageHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, rtDisplayImage );
+
+    rtTexWidth = rtImageWidth;
+    rtTexHeight = rtImageHeight;
+
+  } else if (dirtyTiles.size() > 0)
+
+    uploadRTTiles( dirtyTiles );
+
+  // Set up the full-screen quad
+
+  if (rtQuadVAO == 0) {
 
-  glGenVertexArrays( 1, &VAO );
-  glBindVertexArray( VAO );
+    vec2 verts[8] = {
+      vec2( -1, -1 ), vec2( -1, 1 ), vec2( 1, -1 ), vec2( 1, 1 ), // positions
+      vec2(  0,  0 ), vec2(  0, 1 ), vec2( 1,  0 ), vec2( 1, 1 )  // texture coordinates
+    };
 
-  glGenBuffers( 1, &VBO );
-  glBindBuffer( GL_ARRAY_BUFFER, VBO );
+    glGenVertexArrays( 1, &rtQuadVAO );
+    glBindVertexArray( rtQuadVAO );
 
-  glBufferData( GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW );
+    GLuint VBO;
+    glGenBuffers( 1, &VBO );
+    glBindBuffer( GL_ARRAY_BUFFER, VBO );
 
-  glEnableVertexAttribArray( 0 );
-  glVertexAttribPointer( 0, 2, GL_FLOAT, GL_FALSE, 0, 0 );
+    glBufferData( GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW );
 
-  glEnableVertexAttribArray( 1 );
-  glVertexAttribPointer( 1, 2, GL_FLOAT, GL_FALSE, 0, (void*) (sizeof(vec2)*4) );
+    glEnableVertexAttribArray( 0 );
+    glVertexAttribPointer( 0, 2, GL_FLOAT, GL_FALSE, 0, 0 );
+
+    glEnableVertexAttribArray( 1 );
+    glVertexAttribPointer( 1, 2, GL_FLOAT, GL_FALSE, 0, (void*) (sizeof(vec2)*4) );
+  }
+
+  // Draw texture on the quad
+
+  glBindVertexArray( rtQuadVAO );
 
   glDisable( GL_DEPTH_TEST );
   glEnable( GL_BLEND );
@@ -869,13 +1324,89 @@ void Scene::drawRTImage()
   glDisable( GL_BLEND );
   glEnable( GL_DEPTH_TEST );
 
-  glDeleteBuffers( 1, &VBO );
-  glDeleteVertexArrays( 1, &VAO );
-
+  glBindVertexArray( 0 );
   glBindTexture( GL_TEXTURE_2D, 0 );
 }
 
 
+// Send some tiles of the RT image to the bound texture.
+//
+// With UPLOAD_WITH_PBO, the tiles are packed into a pixel buffer
+// object, from which the texture is updated.  The transfer from the
+// buffer then doesn't stall the GL thread, and the buffer's storage is
+// orphaned on each call so that the next upload doesn't wait for this
+// one.  If the buffer can't be mapped, the tiles are sent directly
+// from rtDisplayImage.
+
+void Scene::uploadRTTiles( seq<Tile> &tiles )
+
+{
+  RGBA8 *packed = NULL;
+
+  if (UPLOAD_WITH_PBO) {
+
+    GLsizeiptr size = 0;
+    for (int i=0; i<tiles.size(); i++)
+      size += (tiles[i].x1 - tiles[i].x0) * (tiles[i].y1 - tiles[i].y0) * sizeof(RGBA8);
+
+    if (rtImagePBO == 0)
+      glGenBuffers( 1, &rtImagePBO );
+
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, rtImagePBO );
+    glBufferData( GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW );
+
+    packed = (RGBA8 *) glMapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT );
+
+    if (packed == NULL)
+      glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+  }
+
+  if (packed != NULL) {
+
+    // Copy the tiles into the buffer, one after another
+
+    RGBA8 *p = packed;
+
+    for (int i=0; i<tiles.size(); i++) {
+      Tile &t = tiles[i];
+      for (int y=t.y0; y<t.y1; y++) {
+        memcpy( p, &rtDisplayImage[ t.x0 + y * rtImageWidth ], (t.x1 - t.x0) * sizeof(RGBA8) );
+        p += t.x1 - t.x0;
+      }
+    }
+
+    glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+
+    // Update the texture from the buffer (where the pointer is an
+    // offset into the buffer)
+
+    size_t offset = 0;
+
+    for (int i=0; i<tiles.size(); i++) {
+      Tile &t = tiles[i];
+      glTexSubImage2D( GL_TEXTURE_2D, 0, t.x0, t.y0, t.x1 - t.x0, t.y1 - t.y0, GL_RGBA, GL_UNSIGNED_BYTE, (void *) offset );
+      offset += (t.x1 - t.x0) * (t.y1 - t.y0) * sizeof(RGBA8);
+    }
+
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+
+  } else {
+
+    // Update the texture directly from rtDisplayImage, whose rows are
+    // rtImageWidth long
+
+    glPixelStorei( GL_UNPACK_ROW_LENGTH, rtImageWidth );
+
+    for (int i=0; i<tiles.size(); i++) {
+      Tile &t = tiles[i];
+      glTexSubImage2D( GL_TEXTURE_2D, 0, t.x0, t.y0, t.x1 - t.x0, t.y1 - t.y0, GL_RGBA, GL_UNSIGNED_BYTE, &rtDisplayImage[ t.x0 + t.y0 * rtImageWidth ] );
+    }
+
+    glPixelStorei( GL_UNPACK_ROW_LENGTH, 0 );
+  }
+}
+
+
 
 const char *Scene::rtTextureVertShader = R"(
 
@@ -9,6 +9,9 @@
 class RTwindow;
 
 
+#define ADAPTIVE_MIN_SAMPLES 4	// samples per pixel before the noise is estimated
+
+
 #include <iostream>
 #include "seq.h"
 #include "linalg.h"
@@ -19,6 +22,31 @@ class RTwindow;
 #include "axes.h"
 #include "drawSegs.h"
 #include "arrow.h"
+#include "tileRenderer.h"
+#include "sampler.h"
+#include "sceneBVH.h"
+#include "emitters.h"
+#include "pixelStats.h"
+
+
+// Numbers of rays traced
+
+class RayCounts {
+
+ public:
+
+  long long primary;		// from the eye
+  long long secondary;		// reflected
+  long long shadow;		// toward lights and emitters
+
+  RayCounts() {
+    primary = secondary = shadow = 0;
+  }
+
+  long long total() {
+    return primary + secondary + shadow;
+  }
+};
 
 
 class Scene {
@@ -28,10 +56,13 @@ class Scene {
   Eye *         eye;		// viewpoint
   seq<Light *>  lights;		// all lights
   seq<Object *> objects;	// all objects
+  SceneBVH      objectBVH;	// two-level BVH over all objects
+  Emitters      emitters;	// all emitting triangles
 
   vec3        Ia;		// ambient illumination
 
   vec3  llCorner, up, right;	// window parameters
+  vec3  rayOrigin;		// eye position when the RT image was started
 
   seq<vec3> storedPoints;
 
@@ -41,11 +72,28 @@ class Scene {
   // rtImage rendering
 
   GLuint rtImageTexID;
-  vec4 *rtImage;		// texture storing the raytraced image
+  int    rtTexWidth, rtTexHeight; // size of the texture's storage (0 if none yet)
+  GLuint rtImagePBO;		// pixel buffer object for uploads (0 if none yet)
+  GLuint rtQuadVAO;		// full-screen quad on which the texture is drawn (0 if none yet)
+  RGBA8 *rtImage;		// texture storing the raytraced image (written by the workers)
+  RGBA8 *rtDisplayImage;	// copy of rtImage's finished tiles, which the GL thread displays
+  int   rtImageWidth, rtImageHeight;
   static const char *rtTextureVertShader, *rtTextureFragShader;
   GPUProgram *gpu;
   GPUProgram *wavefrontGPU;
 
+  TileRenderer *renderer;	// traces rtImage on worker threads
+  float progressShown;		// renderer progress when the screen was last updated
+  bool restartPending;		// waiting for the workers to stop before restarting
+
+  static thread_local RayCounts threadRayCounts; // this thread's rays, not yet added to 'rayCounts'
+  std::mutex rayCountsLock;
+
+  void setupCamera( int width, int height );
+  void startRT( int width, int height, bool progressive );
+  void setupSampleOrder();
+  void writeRTImage( const char *filename );
+
  public:
 
   vec2 mouse;
@@ -67,9 +115,16 @@ class Scene {
   bool showBVH;
   bool showObjects;
   bool jitter;
-  int numPixelSamples;
+  int numPixelSamples;		// (the max in each dimension, with adaptive sampling)
+  float targetNoise;		// adaptive sampling stops at this std error of pixel brightness (0 = off)
+  seq<int> sampleOrder;		// order of a pixel's samples with adaptive sampling
+  int packetSize;		// primary rays traced together (1 = no packets)
+  int numEmitterSamples;	// shadow rays to emitters per shading point
+  int numThreads;		// number of ray tracing threads
+  unsigned int randomSeed;	// seed for all sampling (same seed = same image)
   int bvhDisplayDepth;
-  bool debug;
+  RayCounts rayCounts;		// rays traced by the workers
+  static thread_local bool debug;
   vec2 debugPixel;
 
   float sceneScale; // max dimension of scene's bounding box (used to scale the debbugging arrows)
@@ -77,12 +132,16 @@ class Scene {
 
   Segs *segs; 		// draw some verts
 
-  Scene() {
+  // Nothing is set up for OpenGL here, so a Scene can be read and
+  // ray traced without a window.  The GL objects are made when the
+  // scene is first drawn.
 
-    wavefrontGPU = new GPUProgram();
-    wavefrontGPU->init( wavefrontVertexShader, wavefrontFragmentShader, "in Scene() constructor" );
+  Scene() {
 
-    segs = new Segs();
+    win = NULL;
+    eye = NULL;
+    wavefrontGPU = NULL;
+    segs = NULL;
 
     Ia = vec3(0.1,0.1,0.1);
     maxDepth = 5;
@@ -92,13 +151,28 @@ class Scene {
     showAxes = false;
     showObjects = true;
     rtImage = NULL;
+    rtDisplayImage = NULL;
+    rtImageWidth = 0;
+    rtImageHeight = 0;
     rtImageTexID = 0;
+    rtTexWidth = 0;
+    rtTexHeight = 0;
+    rtImagePBO = 0;
+    rtQuadVAO = 0;
+    renderer = new TileRenderer( this );
+    progressShown = 0;
+    restartPending = false;
     gpu = NULL;
     axes = NULL;
     arrow = NULL;
     stop = false;
     jitter = false;
     numPixelSamples = 1;
+    packetSize = 8;
+    numEmitterSamples = 16;
+    targetNoise = 0.005;
+    numThreads = MAX( 1, (int) std::thread::hardware_concurrency() );
+    randomSeed = 0;
     debug = false;
     debugPixel = vec2(-1,-1);
     sceneScale = 1;
@@ -112,17 +186,29 @@ class Scene {
   }
 
   void renderRT( bool restart );
+  void renderToFile( const char *filename, int width, int height );
+  float renderImage( int width, int height );
+  void addThreadRayCounts();
+  void stopRT();
   void renderGL( mat4 &WCS_to_VCS, mat4 &VCS_to_CCS );
   void draw_RT_and_GL( mat4 &WCS_to_VCS, mat4 &VCS_to_CCS );
   void showPixelZoom( vec2 mouse );
   void read( const char *basename, istream &in );
   void write( ostream &out );
   vec3 pixelColour( int x, int y );
-  vec3 raytrace( vec3 &rayStart, vec3 &rayDir, int depth, float weight, int thisObjIndex, int thisObjPartIndex );
+  void blockColours( int x0, int y0, int x1, int y1, vec3 *colours );
+  vec3 sampleColour( int x, int y, int sample );
+  bool needsMoreSamples( PixelStats &stats );
+  int  sampleIndex( int k );
+  void sampleColours( int n, int *xs, int *ys, int *samples, vec3 *colours );
+  vec3 sampleDir( int x, int y, float ii, float jj, Sampler &sampler );
+  vec3 raytrace( vec3 &rayStart, vec3 &rayDir, int depth, float weight, int thisObjIndex, int thisObjPartIndex, Sampler &sampler );
+  vec3 hitColour( vec3 &rayDir, bool hit, RayHit &h, int depth, float weight, float weight_factor, int thisObjIndex, Sampler &sampler );
   vec3 calcIout( vec3 N, vec3 L, vec3 E, vec3 R,
 		   vec3 Kd, vec3 Ks, float ns, vec3 In );
   bool findFirstObjectInt( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, 
 			   vec3 &P, vec3 &N, vec3 &T, float &param, int &objIndex, int &objPartIndex, Material *&mat, int lightIndex );
+  bool isShadowed( vec3 P, vec3 L, float Ldist, int objIndex, int objPartIndex, int lightIndex );
 
   void outputEye() { 
     cout << *eye << endl; 
@@ -131,6 +217,7 @@ class Scene {
   void display();
   void drawStoredRays( GPUProgram *gpuProg, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS );
   void drawRTImage();
+  void uploadRTTiles( seq<Tile> &tiles );
   char *statusMessage();
 
   static const char* wavefrontVertexShader;
@@ -0,0 +1,434 @@
+// sceneBVH.cpp
+
+
+#include "headers.h"
+#include "sceneBVH.h"
+
+#include <algorithm>
+#include <chrono>
+
+
+// Build the tree over entries 'indices' with bounding boxes 'boxes'.
+//
+// There are few objects in a scene compared to the triangles in a
+// mesh, so each node is simply split at the median centre along the
+// longest axis of its entries' centres.
+
+void ObjectTree::build( seq<int> &indices, seq<BBox> &boxes )
+
+{
+  nodes.clear();
+  entries.clear();
+
+  Entry *ents = new Entry[ indices.size() ];
+  int n = 0;
+
+  for (int i=0; i<indices.size(); i++)
+    if (boxes[i].min.x <= boxes[i].max.x) { // skip empty objects
+
+      // Pad the box slightly so that a flat triangle's box has some
+      // thickness
+
+      vec3 d = boxes[i].max - boxes[i].min;
+      float pad = 0.0001 * MAX( 1, MAX( d.x, MAX( d.y, d.z ) ) );
+
+      ents[n].index  = indices[i];
+      ents[n].bbox   = BBox( boxes[i].min - vec3(pad,pad,pad), boxes[i].max + vec3(pad,pad,pad) );
+      ents[n].centre = ents[n].bbox.centre();
+      n++;
+    }
+
+  if (n > 0) {
+
+    nodes.add( BVH_flatNode() );
+
+    stackSize = buildSubtree( 0, ents, n );
+  }
+
+  delete [] ents;
+}
+
+
+// Fill in nodes[nodeIndex] for the 'n' entries starting at 'ents'.
+// Returns the traversal stack size needed for this subtree.
+
+int ObjectTree::buildSubtree( int nodeIndex, Entry *ents, int n )
+
+{
+  BBox bbox = ents[0].bbox;
+  BBox centreBox( ents[0].centre, ents[0].centre );
+
+  for (int i=1; i<n; i++) {
+    bbox.expand( ents[i].bbox );
+    centreBox.expand( ents[i].centre );
+  }
+
+  nodes[nodeIndex].bbox = bbox;
+  nodes[nodeIndex].pad = 0;
+
+  if (n <= OBJECT_LEAF_SIZE) {
+
+    nodes[nodeIndex].isLeaf = 1;
+    nodes[nodeIndex].offset = entries.size();
+    nodes[nodeIndex].count  = n;
+
+    for (int i=0; i<n; i++)
+      entries.add( ents[i].index );
+
+    return 1;
+  }
+
+  // Split at the median along the longest axis
+
+  vec3 extent = centreBox.max - centreBox.min;
+
+  int axis = 0;
+  if (extent.y > extent[axis]) axis = 1;
+  if (extent.z > extent[axis]) axis = 2;
+
+  int mid = n/2;
+
+  std::nth_element( ents, ents+mid, ents+n,
+                    [axis]( Entry const& a, Entry const& b ) { return a.centre[axis] < b.centre[axis]; } );
+
+  // Children are stored next to each other
+
+  int firstChild = nodes.size();
+
+  nodes[nodeIndex].isLeaf = 0;
+  nodes[nodeIndex].offset = firstChild;
+  nodes[nodeIndex].count  = 2;
+
+  nodes.add( BVH_flatNode() );
+  nodes.add( BVH_flatNode() );
+
+  int leftNeeded  = buildSubtree( firstChild,   ents,     mid );
+  int rightNeeded = buildSubtree( firstChild+1, ents+mid, n-mid );
+
+  return MAX( leftNeeded, rightNeeded+1 ); // the left child waits on the stack
+}
+
+
+// Build the two levels.  This must be called again if objects are
+// added to the scene.
+
+void SceneBVH::build( seq<Object*> &objs )
+
+{
+  auto startTime = std::chrono::steady_clock::now();
+
+  objects = &objs;
+
+  seq<int>  topIndices, primIndices;
+  seq<BBox> topBoxes, primBoxes;
+
+  BBox primBox;
+  primBox.makeEmpty();
+
+  for (int i=0; i<objs.size(); i++) {
+
+    BBox b = objs[i]->bbox();
+
+    if (objs[i]->isConvex()) { // a loose primitive
+      primIndices.add( i );
+      primBoxes.add( b );
+      primBox.expand( b );
+    } else {
+      topIndices.add( i );
+      topBoxes.add( b );
+    }
+  }
+
+  primitives.build( primIndices, primBoxes );
+
+  if (primIndices.size() > 0) {
+    topIndices.add( PRIMITIVE_GROUP );
+    topBoxes.add( primBox );
+  }
+
+  topLevel.build( topIndices, topBoxes );
+
+  BVH::totalBuildTime += std::chrono::duration<double>( std::chrono::steady_clock::now() - startTime ).count();
+}
+
+
+// Find the first object intersected.  The arguments are as for
+// Scene::findFirstObjectInt().
+
+bool SceneBVH::rayInt( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex,
+                       vec3 &P, vec3 &N, vec3 &T, float &param, int &objIndex, int &objPartIndex, Material *&mat )
+
+{
+  // 1/rayDir handles division by zero correctly (i.e. IEEE Inf)
+
+  vec3 invDir( 1.0f / rayDir.x, 1.0f / rayDir.y, 1.0f / rayDir.z );
+
+  float maxParam = MAXFLOAT;
+
+  return treeRayInt( topLevel, rayStart, rayDir, invDir, thisObjIndex, thisObjPartIndex, maxParam,
+                     P, N, T, param, objIndex, objPartIndex, mat );
+}
+
+
+// Traverse one tree with an explicit stack, as in BVH::rayInt().
+// 'maxParam' is reduced as closer hits are found.
+
+bool SceneBVH::treeRayInt( ObjectTree &tree, vec3 &rayStart, vec3 &rayDir, vec3 &invDir, int thisObjIndex, int thisObjPartIndex, float &maxParam,
+                           vec3 &P, vec3 &N, vec3 &T, float &param, int &objIndex, int &objPartIndex, Material *&mat )
+
+{
+  if (tree.nodes.size() == 0)
+    return false;
+
+  BVH_stack<int>   stackNodeEntries( tree.stackSize );
+  BVH_stack<float> stackTEntries( tree.stackSize );
+
+  int   *stackNode = stackNodeEntries.entries;
+  float *stackT    = stackTEntries.entries;
+  int    stackTop;
+
+  float tNear;
+
+  if (!tree.nodes[0].bbox.rayInt( rayStart, invDir, maxParam, tNear ))
+    return false;
+
+  stackNode[0] = 0;
+  stackT[0] = tNear;
+  stackTop = 1;
+
+  bool hit = false;
+
+  while (stackTop > 0) {
+
+    stackTop--;
+
+    if (stackT[stackTop] > maxParam)
+      continue;
+
+    BVH_flatNode &n = tree.nodes[ stackNode[stackTop] ];
+
+    if (n.isLeaf) {
+
+      for (int i=n.offset; i<n.offset+n.count; i++) {
+
+        int entry = tree.entries[i];
+
+        if (entry == PRIMITIVE_GROUP) {
+          if (treeRayInt( primitives, rayStart, rayDir, invDir, thisObjIndex, thisObjPartIndex, maxParam,
+                          P, N, T, param, objIndex, objPartIndex, mat ))
+            hit = true;
+        } else {
+          if (objectRayInt( entry, rayStart, rayDir, thisObjIndex, thisObjPartIndex, maxParam,
+                            P, N, T, param, objIndex, objPartIndex, mat ))
+            hit = true;
+        }
+      }
+
+    } else {
+
+      for (int i=n.offset; i<n.offset+n.count; i++)
+        if (tree.nodes[i].bbox.rayInt( rayStart, invDir, maxParam, tNear )) {
+          stackNode[stackTop] = i;
+          stackT[stackTop] = tNear;
+          stackTop++;
+        }
+    }
+  }
+
+  return hit;
+}
+
+
+// Is any object hit between parameters 0 and 'maxParam'?  This stops
+// at the first object found, which need not be the closest.
+
+bool SceneBVH::rayOccluded( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, float maxParam )
+
+{
+  vec3 invDir( 1.0f / rayDir.x, 1.0f / rayDir.y, 1.0f / rayDir.z );
+
+  return treeRayOccluded( topLevel, rayStart, rayDir, invDir, thisObjIndex, thisObjPartIndex, maxParam );
+}
+
+
+bool SceneBVH::treeRayOccluded( ObjectTree &tree, vec3 &rayStart, vec3 &rayDir, vec3 &invDir, int thisObjIndex, int thisObjPartIndex, float maxParam )
+
+{
+  if (tree.nodes.size() == 0)
+    return false;
+
+  BVH_stack<int> stackEntries( tree.stackSize );
+  int *stack = stackEntries.entries;
+  int  stackTop = 0;
+
+  float tNear;
+
+  if (!tree.nodes[0].bbox.rayInt( rayStart, invDir, maxParam, tNear ))
+    return false;
+
+  stack[stackTop++] = 0;
+
+  while (stackTop > 0) {
+
+    BVH_flatNode &n = tree.nodes[ stack[--stackTop] ];
+
+    if (n.isLeaf) {
+
+      for (int i=n.offset; i<n.offset+n.count; i++) {
+
+        int entry = tree.entries[i];
+
+        if (entry == PRIMITIVE_GROUP) {
+
+          if (treeRayOccluded( primitives, rayStart, rayDir, invDir, thisObjIndex, thisObjPartIndex, maxParam ))
+            return true;
+
+        } else {
+
+          Object *obj = (*objects)[entry];
+
+          if (entry == thisObjIndex && obj->isConvex())
+            continue;
+
+          if (obj->rayOccluded( rayStart, rayDir, ((entry != thisObjIndex) ? -1 : thisObjPartIndex), maxParam ))
+            return true;
+        }
+      }
+
+    } else {
+
+      for (int i=n.offset; i<n.offset+n.count; i++)
+        if (tree.nodes[i].bbox.rayInt( rayStart, invDir, maxParam, tNear ))
+          stack[stackTop++] = i;
+    }
+  }
+
+  return false;
+}
+
+
+// Find the first object intersected by each ray of a packet, which
+// has been set up with RayPacket::setup().  The closest hit of ray r
+// is left in packet.hits[r] if bit r of the returned mask is set.
+//
+// This gives the same hits as rayInt() on each ray.  The packet goes
+// through the trees together, and objects that have their own BVHs
+// trace it further as a packet.
+
+unsigned int SceneBVH::packetRayInt( RayPacket &packet )
+
+{
+  treePacketRayInt( topLevel, packet, packet.allRays() );
+
+  unsigned int hitMask = 0;
+
+  for (int r=0; r<packet.numRays; r++)
+    if (packet.maxParam[r] < MAXFLOAT)
+      hitMask |= (1u << r);
+
+  return hitMask;
+}
+
+
+void SceneBVH::treePacketRayInt( ObjectTree &tree, RayPacket &packet, unsigned int rayMask )
+
+{
+  if (tree.nodes.size() == 0)
+    return;
+
+  BVH_stack<int>          stackNodeEntries( tree.stackSize );
+  BVH_stack<unsigned int> stackMaskEntries( tree.stackSize );
+
+  int          *stackNode = stackNodeEntries.entries;
+  unsigned int *stackMask = stackMaskEntries.entries;
+  int           stackTop;
+
+  rayMask = packet.boxMask( tree.nodes[0].bbox, rayMask );
+
+  if (rayMask == 0)
+    return;
+
+  stackNode[0] = 0;
+  stackMask[0] = rayMask;
+  stackTop = 1;
+
+  while (stackTop > 0) {
+
+    stackTop--;
+
+    BVH_flatNode &n = tree.nodes[ stackNode[stackTop] ];
+    unsigned int mask = stackMask[stackTop];
+
+    if (n.isLeaf) {
+
+      for (int i=n.offset; i<n.offset+n.count; i++) {
+
+        int entry = tree.entries[i];
+
+        if (entry == PRIMITIVE_GROUP)
+          treePacketRayInt( primitives, packet, mask );
+
+        else {
+
+          Object *obj = (*objects)[entry];
+
+          if (entry == packet.thisObjIndex && obj->isConvex())
+            continue;
+
+          unsigned int hitMask = obj->packetRayInt( packet, mask, ((entry != packet.thisObjIndex) ? -1 : packet.thisObjPartIndex) );
+
+          for (int r=0; r<packet.numRays; r++)
+            if (hitMask & (1u << r))
+              packet.hits[r].objIndex = entry;
+        }
+      }
+
+    } else {
+
+      for (int i=n.offset; i<n.offset+n.count; i++) {
+        unsigned int childMask = packet.boxMask( tree.nodes[i].bbox, mask );
+        if (childMask != 0) {
+          stackNode[stackTop] = i;
+          stackMask[stackTop] = childMask;
+          stackTop++;
+        }
+      }
+    }
+  }
+}
+
+
+// Intersect with objects[i], recording the hit if it is closer than
+// 'maxParam'.
+
+bool SceneBVH::objectRayInt( int i, vec3 &rayStart, vec3 &rayDir, int thisObjIndex, int thisObjPartIndex, float &maxParam,
+                             vec3 &P, vec3 &N, vec3 &T, float &param, int &objIndex, int &objPartIndex, Material *&mat )
+
+{
+  Object *obj = (*objects)[i];
+
+  // don't check for int with the originating object for convex objects
+
+  if (i == thisObjIndex && obj->isConvex())
+    return false;
+
+  vec3 point, normal, texcoords;
+  float t;
+  Material *intMat;
+  int intPartIndex;
+
+  if (!obj->rayInt( rayStart, rayDir, ((i != thisObjIndex) ? -1 : thisObjPartIndex), maxParam, point, normal, texcoords, t, intMat, intPartIndex ))
+    return false;
+
+  P = point;
+  N = normal;
+  T = texcoords;
+  param = t;
+  objIndex = i;
+  objPartIndex = intPartIndex;
+  mat = intMat;
+
+  maxParam = t; // In future, don't intersect any farther than this
+
+  return true;
+}
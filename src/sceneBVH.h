@@ -0,0 +1,88 @@
+// sceneBVH.h
+//
+// Two-level bounding volume hierarchy over the scene's objects.
+//
+// The top level is a tree over the bounding boxes of the Wavefront
+// objects, each of which has its own triangle BVH as the bottom level.
+// The loose triangles and spheres of the scene are grouped into one
+// more bottom-level tree, which is a single entry in the top level.
+// A ray then only visits the objects whose boxes it passes through.
+
+
+#ifndef SCENE_BVH_H
+#define SCENE_BVH_H
+
+
+#include "seq.h"
+#include "object.h"
+#include "bvh.h"
+
+
+#define OBJECT_LEAF_SIZE  2     // max entries in a leaf of an ObjectTree
+#define PRIMITIVE_GROUP  -1     // top-level entry for the tree of loose primitives
+
+
+// A tree over a set of entries with bounding boxes, stored as
+// flattened nodes like those of the triangle BVH.  Each leaf's
+// entries are contiguous in 'entries'.
+
+class ObjectTree {
+
+  class Entry {
+  public:
+    int  index;
+    BBox bbox;
+    vec3 centre;
+  };
+
+  int buildSubtree( int nodeIndex, Entry *ents, int n );
+
+ public:
+
+  seq<BVH_flatNode> nodes;	// nodes[0] is the root (if there are any entries)
+  seq<int>          entries;	// object indices (or PRIMITIVE_GROUP) in leaf order
+  int               stackSize;	// traversal stack entries needed
+
+  ObjectTree() {
+    stackSize = 1;
+  }
+
+  void build( seq<int> &indices, seq<BBox> &boxes );
+};
+
+
+class SceneBVH {
+
+  seq<Object*> *objects;
+
+  ObjectTree topLevel;		// over Wavefront objects and the primitive group
+  ObjectTree primitives;	// over loose triangles and spheres
+
+  bool treeRayInt( ObjectTree &tree, vec3 &rayStart, vec3 &rayDir, vec3 &invDir, int thisObjIndex, int thisObjPartIndex, float &maxParam,
+		   vec3 &P, vec3 &N, vec3 &T, float &param, int &objIndex, int &objPartIndex, Material *&mat );
+
+  bool treeRayOccluded( ObjectTree &tree, vec3 &rayStart, vec3 &rayDir, vec3 &invDir, int thisObjIndex, int thisObjPartIndex, float maxParam );
+
+  void treePacketRayInt( ObjectTree &tree, RayPacket &packet, unsigned int rayMask );
+
+  bool objectRayInt( int i, vec3 &rayStart, vec3 &rayDir, int thisObjIndex, int thisObjPartIndex, float &maxParam,
+		     vec3 &P, vec3 &N, vec3 &T, float &param, int &objIndex, int &objPartIndex, Material *&mat );
+
+ public:
+
+  SceneBVH() {
+    objects = NULL;
+  }
+
+  void build( seq<Object*> &objects );
+
+  bool rayInt( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex,
+	       vec3 &P, vec3 &N, vec3 &T, float &param, int &objIndex, int &objPartIndex, Material *&mat );
+
+  bool rayOccluded( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, float maxParam );
+
+  unsigned int packetRayInt( RayPacket &packet );
+};
+
+
+#endif
@@ -9,10 +9,12 @@
  *   CONSTRUCTORS
  *
  *     seq()               Create an empty sequence
+ *     seq( n )            Create an empty sequence with storage for n elements
  *
  *   PUBLIC FUNCTIONS
  *
  *     add( x )            Add x to the end of the sequence
+ *     emplace( args )     Add T(args) to the end of the sequence and return it
  *     remove()            Remove the last element of the sequence
  *     remove( i )         Remove the i^{th} element of the sequence (expensive)
  *     shift( i )          Shift right everything starting at position i
@@ -20,6 +22,13 @@
  *     exists( x )         Return true if x exists in sequence, false otherwise
  *     clear()             Deletes the whole sequence
  *     findIndex( x )      Find the index of element x, or -1 if it doesn't exist
+ *     reserve( n )        Make sure there's storage for at least n elements
+ *     resize( n )         Make the sequence n long, padding with T()
+ *     begin(), end()      Pointers to the first and past the last elements
+ *
+ * operator[] checks its index unless NDEBUG is defined, so release
+ * builds don't pay for the check on every access.  Elements are moved,
+ * not copied, when the storage grows.
  */
 
 
@@ -28,6 +37,7 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <utility>
 
 using namespace std;
 
@@ -38,6 +48,9 @@ template<class T> class seq {
   int numElements;
   T  *data;
 
+  void setStorageSize( int n );
+  void grow();
+
 public:
 
   seq() {			// constructor
@@ -47,7 +60,7 @@ public:
   }
 
   seq( int n ) {		// constructor
-    storageSize = n;
+    storageSize = (n > 0 ? n : 1);
     numElements = 0;
     data = new T[ storageSize ];
   }
@@ -57,7 +70,6 @@ public:
   }
 
   seq( const seq<T> & source ) { // copy constructor
-
     storageSize = source.storageSize;
     numElements = source.numElements;
     data = new T[ storageSize ];
@@ -65,6 +77,15 @@ public:
       data[i] = source.data[i];
   }
 
+  seq( seq<T> && source ) {	// move constructor
+    storageSize = source.storageSize;
+    numElements = source.numElements;
+    data = source.data;
+    source.storageSize = 1;	// leave the source empty but usable
+    source.numElements = 0;
+    source.data = new T[ 1 ];
+  }
+
   void remove() {
     if (numElements == 0) {
       cerr << "remove: Tried to remove element from empty sequence\n";
@@ -93,18 +114,19 @@ public:
   }
 
   T & operator [] ( int i ) const {
+#ifndef NDEBUG
     if (i >= numElements || i < 0) {
       cerr << "element: Tried to access an element beyond the range of the sequence: "
 	   << i << "(numElements = " << numElements << ")\n";
-      { int i = 0;
-      int j = 1 / i;
-      j = j;
-      }
-      exit(-1);
+      abort();			// (stops in the debugger)
     }
+#endif
     return data[ i ];
   }
 
+  T * begin() const { return data; }
+  T * end() const   { return data + numElements; }
+
   void clear() {
     delete [] data;
     storageSize = 1;
@@ -113,6 +135,8 @@ public:
   }
 
   seq<T> & operator = (const seq<T> &source) { // assignment operator
+    if (this == &source)
+      return *this;
     storageSize = source.storageSize;
     numElements = source.numElements;
     delete [] data;
@@ -122,36 +146,104 @@ public:
     return *this;
   }
 
-  void add( const T &x );
+  seq<T> & operator = (seq<T> &&source) { // move assignment operator
+    if (this == &source)
+      return *this;
+    std::swap( storageSize, source.storageSize );
+    std::swap( numElements, source.numElements );
+    std::swap( data, source.data );
+    source.numElements = 0;	// (source frees our old storage)
+    return *this;
+  }
+
+  void add( const T &x ) {
+    if (numElements == storageSize) {
+      T copy( x );		// x might be one of our own elements
+      grow();
+      data[ numElements++ ] = std::move( copy );
+    } else
+      data[ numElements++ ] = x;
+  }
+
+  void add( T &&x ) {
+    if (numElements == storageSize) {
+      T moved( std::move( x ) );
+      grow();
+      data[ numElements++ ] = std::move( moved );
+    } else
+      data[ numElements++ ] = std::move( x );
+  }
+
+  // The storage already holds default-constructed elements, so the
+  // new element is constructed here and moved into place.
+
+  template<class... Args> T & emplace( Args&&... args ) {
+    T x( std::forward<Args>( args )... );
+    if (numElements == storageSize)
+      grow();
+    data[ numElements ] = std::move( x );
+    return data[ numElements++ ];
+  }
+
+  void reserve( int n ) {
+    if (n > storageSize)
+      setStorageSize( n );
+  }
+
+  void resize( int n );
+
   int findIndex( const T &x );
   bool exists( const T &x );
 };
 
 
-// Add an element to the end of the sequence
+// Move the elements into new storage of n elements (n >= numElements)
 
 template<class T>
 void 
-seq<T>::add( const T &x )
+seq<T>::setStorageSize( int n )
 
 {
-  // No storage left?  If so, double the storage
+  T *newData;
 
-  if (numElements == storageSize) {
-    T *newData;
+  newData = new T[ n ];
+  for (int i=0; i<numElements; i++)
+    newData[i] = std::move( data[i] );
+  storageSize = n;
+  delete [] data;
+  data = newData;
+}
 
-    newData = new T[ storageSize * 2 ];
-    for (int i=0; i<storageSize; i++)
-      newData[i] = data[i];
-    storageSize = storageSize * 2;
-    delete [] data;
-    data = newData;
+
+// No storage left, so double the storage
+
+template<class T>
+void 
+seq<T>::grow()
+
+{
+  setStorageSize( storageSize * 2 );
+}
+
+
+// Set the number of elements, padding with T()
+
+template<class T>
+void 
+seq<T>::resize( int n )
+
+{
+  if (n < 0) {
+    cerr << "resize: Tried to resize a sequence to " << n << " elements\n";
+    exit(-1);
   }
 
-  // Store the element in the next available position
+  reserve( n );
 
-  data[ numElements ] = x;
-  numElements++;
+  for (int i=numElements; i<n; i++)
+    data[i] = T();
+
+  numElements = n;
 }
 
 
@@ -162,17 +254,10 @@ void
 seq<T>::compress()
 
 {
-  T *newData;
-
-  if (numElements == storageSize)
+  if (numElements == storageSize || numElements == 0)
     return;
 
-  newData = new T[ numElements ];
-  for (int i=0; i<numElements; i++)
-    newData[i] = data[i];
-  storageSize = numElements;
-  delete [] data;
-  data = newData;
+  setStorageSize( numElements );
 }
 
 
@@ -219,19 +304,11 @@ seq<T>::shift( int i )
     exit(-1);
   }
 
-  if (numElements == storageSize) {
-    T *newData;
-
-    newData = new T[ storageSize * 2 ];
-    for (int i=0; i<storageSize; i++)
-      newData[i] = data[i];
-    storageSize = storageSize * 2;
-    delete [] data;
-    data = newData;
-  }
+  if (numElements == storageSize)
+    grow();
 
   for (int j=numElements; j>i; j--)
-    data[j] = data[j-1];
+    data[j] = std::move( data[j-1] );
 
   numElements++;
 }
@@ -247,14 +324,11 @@ seq<T>::remove( int i )
   if (i < 0 || i >= numElements) {
     cerr << "remove: Tried to remove element " << i
 	 << " from a sequence of " << numElements << " elements \n";
-    { int i = 0;
-    int j = 1 / i;
-    }
-    exit(-1);
+    abort();
   }
 
   for (int j=i; j<numElements-1; j++)
-    data[j] = data[j+1];
+    data[j] = std::move( data[j+1] );
 
   numElements--;
 }
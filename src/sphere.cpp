@@ -214,6 +214,12 @@ bool Sphere::rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxPara
 
   intParam = (t0 < t1 ? t0 : t1);
 
+  if (intParam < 0)
+    intParam = (t0 < t1 ? t1 : t0); // starting inside the sphere
+
+  if (intParam < 0)
+    return false; // sphere is behind starting point
+
   if (intParam > maxParam)
     return false; // too far away
 
@@ -261,6 +267,9 @@ void Sphere::input( istream &stream )
 void Sphere::renderGL( GPUProgram *prog, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS, float s )
 
 {
+  if (VAO == 0)
+    setupVAO();
+
   mat->setMaterialForOpenGL( prog );
 
   mat4 MV  = WCS_to_VCS * translate( centre ) * scale( s, s, s );
@@ -75,7 +75,7 @@ class Sphere: public Object {
 
     //gpu.init( vertShader, fragShader, "in sphere.h" );
 
-    setupVAO();
+    VAO = 0; // set up when first drawn
   };
 
   ~Sphere() {}
@@ -83,6 +83,10 @@ class Sphere: public Object {
   bool rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam,
 	       vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, float &intParam, Material * & mat, int &intPartIndex );
 
+  BBox bbox() {
+    return BBox( centre - vec3(radius,radius,radius), centre + vec3(radius,radius,radius) );
+  }
+
   void input( istream &stream );
   void output( ostream &stream ) const;
 
@@ -31,7 +31,12 @@ class Texture {
 
   char *name;			/* filename */
 
-  Texture() {}
+  Texture() {
+    textureID = 0;
+  }
+
+  // The texture is registered with OpenGL when first used, so that it
+  // can be read without an OpenGL context.
 
   Texture( char *filename ) {
     char *p = strrchr( filename, '.' );
@@ -42,16 +47,18 @@ class Texture {
       texmap = readPNG( filename );
 #endif
     name = strdup( filename );
-    registerWithOpenGL();
+    textureID = 0;
   }
 
   GLuint texID() {
+    if (textureID == 0)
+      registerWithOpenGL();
     return textureID;
   }
 
   void makeActive() {
     glEnable( GL_TEXTURE_2D );
-    glBindTexture( GL_TEXTURE_2D, textureID );
+    glBindTexture( GL_TEXTURE_2D, texID() );
     if (hasAlpha) {
       glEnable(GL_BLEND);
       glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -0,0 +1,390 @@
+// tileRenderer.cpp
+
+
+#include "headers.h"
+#include "tileRenderer.h"
+#include "scene.h"
+
+#include <chrono>
+
+
+TileRenderer::TileRenderer( Scene *s )
+
+{
+  scene = s;
+  image = NULL;
+  width = 0;
+  height = 0;
+  numTilesDone = 0;
+  nextTile = 0;
+  cancelled = false;
+  numWorkersRunning = 0;
+  stats = NULL;
+  statsSize = 0;
+}
+
+
+// Start tracing an image of width x height pixels with 'numThreads'
+// workers, either progressively or in a single full-quality pass.
+// Any render already in progress is cancelled first.
+
+void TileRenderer::start( RGBA8 *img, int w, int h, int numThreads, bool progressive )
+
+{
+  cancel();
+
+  image  = img;
+  width  = w;
+  height = h;
+
+  // Split the image into tiles
+
+  tiles.clear();
+
+  for (int y=0; y<height; y+=TILE_SIZE)
+    for (int x=0; x<width; x+=TILE_SIZE)
+      tiles.add( Tile( x, y, MIN( x+TILE_SIZE, width ), MIN( y+TILE_SIZE, height ) ) );
+
+  // Choose the passes
+
+  passes.clear();
+
+  if (!progressive)
+
+    passes.add( Pass( 1, ALL_SAMPLES ) );
+
+  else {
+
+    for (int blockSize=PROGRESSIVE_BLOCK_SIZE; blockSize>=1; blockSize/=2)
+      passes.add( Pass( blockSize, 0 ) );
+
+    int numSamples = scene->numPixelSamples * scene->numPixelSamples;
+
+    for (int sample=1; sample<numSamples; sample++)
+      passes.add( Pass( 1, sample ) );
+
+    if (statsSize != width * height) {
+      delete [] stats;
+      statsSize = width * height;
+      stats = new PixelStats[ statsSize ];
+    }
+  }
+
+  nextTile = 0;
+  numTilesDone = 0;
+  cancelled = false;
+
+  // Start the workers
+
+  numWorkersRunning = numThreads;
+
+  for (int i=0; i<numThreads; i++)
+    workers.add( new std::thread( &TileRenderer::workerLoop, this ) );
+}
+
+
+// Stop the workers and wait for them to exit.  This must be called
+// before the image or the scene's camera is changed.
+
+void TileRenderer::cancel()
+
+{
+  requestCancel();
+
+  for (int i=0; i<workers.size(); i++) {
+    workers[i]->join();
+    delete workers[i];
+  }
+
+  workers.clear();
+}
+
+
+// Ask the workers to stop, without waiting for them.  Each stops after
+// the block of pixels that it's tracing, and doesn't change the image
+// after this returns.  Once idle() is true, cancel() returns at once.
+
+void TileRenderer::requestCancel()
+
+{
+  {
+    std::lock_guard<std::mutex> lock( progressLock );
+    cancelled = true;
+  }
+  progressCond.notify_all(); // (wakes workers waiting for a pass to finish)
+}
+
+
+// Have all workers left workerLoop()?
+
+bool TileRenderer::idle()
+
+{
+  return numWorkersRunning == 0;
+}
+
+
+// Each worker repeatedly takes the next untraced tile until none
+// remain or the render is cancelled.  Tiles are handed out pass by
+// pass, and a tile of one pass isn't started until all tiles of the
+// previous pass are done, since it overwrites their pixels.
+
+void TileRenderer::workerLoop()
+
+{
+  RGBA8 pixels[ TILE_SIZE * TILE_SIZE ]; // this worker's copy of its tile
+
+  while (!cancelled) {
+
+    int i = nextTile++;
+    if (i >= passes.size() * tiles.size())
+      break;
+
+    int pass = i / tiles.size();
+
+    if (pass > 0) {
+      std::unique_lock<std::mutex> lock( progressLock );
+      progressCond.wait( lock, [&]() { return cancelled || numTilesDone >= pass * tiles.size(); } );
+      if (cancelled)
+        break;
+    }
+
+    Tile &tile = tiles[ i % tiles.size() ];
+
+    if (passes[pass].sample == ALL_SAMPLES)
+      traceTile( tile, pixels );
+    else
+      traceTilePass( tile, passes[pass], pixels );
+    scene->addThreadRayCounts();
+
+    if (!finishTile( tile, pixels ))
+      break;
+  }
+
+  numWorkersRunning--;
+}
+
+
+// Copy a traced tile into the image and count it as done, unless the
+// render has been cancelled.  Returns false if it has.
+
+bool TileRenderer::finishTile( Tile &tile, RGBA8 *pixels )
+
+{
+  {
+    std::lock_guard<std::mutex> lock( progressLock );
+
+    if (cancelled)
+      return false;
+
+    int tileWidth = tile.x1 - tile.x0;
+
+    for (int y=tile.y0; y<tile.y1; y++)
+      memcpy( &image[ tile.x0 + y * width ], &pixels[ (y-tile.y0) * tileWidth ], tileWidth * sizeof(RGBA8) );
+
+    numTilesDone++;
+    tile.dirty = true;
+  }
+  progressCond.notify_all();
+
+  return true;
+}
+
+
+// Trace all samples of a tile's pixels into 'pixels', whose rows are
+// the tile's width
+
+void TileRenderer::traceTile( Tile &tile, RGBA8 *pixels )
+
+{
+  vec3 colours[ PIXEL_BLOCK_SIZE * PIXEL_BLOCK_SIZE ];
+  vec3 tileColours[ TILE_SIZE * TILE_SIZE ];
+
+  int tileWidth = tile.x1 - tile.x0;
+
+  for (int y0=tile.y0; y0<tile.y1; y0+=PIXEL_BLOCK_SIZE)
+    for (int x0=tile.x0; x0<tile.x1; x0+=PIXEL_BLOCK_SIZE) {
+
+      if (cancelled)
+        return;
+
+      int x1 = MIN( x0+PIXEL_BLOCK_SIZE, tile.x1 );
+      int y1 = MIN( y0+PIXEL_BLOCK_SIZE, tile.y1 );
+
+      scene->blockColours( x0, y0, x1, y1, colours );
+
+      for (int y=y0; y<y1; y++)
+        for (int x=x0; x<x1; x++)
+          tileColours[ (x-tile.x0) + (y-tile.y0) * tileWidth ] = colours[ (x-x0) + (y-y0) * (x1-x0) ];
+    }
+
+  // Convert the finished tile for display
+
+  toRGBA8( tileColours, pixels, tileWidth * (tile.y1 - tile.y0) );
+}
+
+
+// Trace one progressive pass over a tile.  In the first passes, only
+// the pixels at the corners of the pass's blocks are traced, skipping
+// those already traced as corners of the previous pass's (twice as
+// large) blocks.  In the later passes, only the pixels that need more
+// samples are traced.  Packets are formed from PIXEL_BLOCK_SIZE x
+// PIXEL_BLOCK_SIZE of these pixels at a time.
+//
+// The pass starts from the tile's pixels in the image, and the result
+// goes to 'pixels', whose rows are the tile's width.
+
+void TileRenderer::traceTilePass( Tile &tile, Pass &pass, RGBA8 *pixels )
+
+{
+  int xs[ PIXEL_BLOCK_SIZE * PIXEL_BLOCK_SIZE ];
+  int ys[ PIXEL_BLOCK_SIZE * PIXEL_BLOCK_SIZE ];
+  int samples[ PIXEL_BLOCK_SIZE * PIXEL_BLOCK_SIZE ];
+  vec3 colours[ PIXEL_BLOCK_SIZE * PIXEL_BLOCK_SIZE ];
+  RGBA8 blockPixels[ PIXEL_BLOCK_SIZE * PIXEL_BLOCK_SIZE ];
+
+  int tileWidth = tile.x1 - tile.x0;
+
+  // Only this worker writes the tile's pixels in the image, so they
+  // can be read without locking
+
+  for (int y=tile.y0; y<tile.y1; y++)
+    memcpy( &pixels[ (y-tile.y0) * tileWidth ], &image[ tile.x0 + y * width ], tileWidth * sizeof(RGBA8) );
+
+  int step = pass.blockSize;
+  int span = step * PIXEL_BLOCK_SIZE;
+
+  bool skipPrevCorners = (pass.sample == 0 && step < PROGRESSIVE_BLOCK_SIZE);
+
+  int sample = scene->sampleIndex( pass.sample );
+
+  for (int y0=tile.y0; y0<tile.y1; y0+=span)
+    for (int x0=tile.x0; x0<tile.x1; x0+=span) {
+
+      if (cancelled)
+        return;
+
+      int n = 0;
+
+      for (int y=y0; y<MIN( y0+span, tile.y1 ); y+=step)
+        for (int x=x0; x<MIN( x0+span, tile.x1 ); x+=step) {
+
+          if (pass.sample == 0) {
+            if (skipPrevCorners && x % (2*step) == 0 && y % (2*step) == 0)
+              continue;
+          } else if (!scene->needsMoreSamples( stats[ x + y * width ] ))
+            continue;
+
+          xs[n] = x;
+          ys[n] = y;
+          samples[n] = sample;
+          n++;
+        }
+
+      if (n == 0)
+        continue;
+
+      scene->sampleColours( n, xs, ys, samples, colours );
+
+      // Accumulate, and convert the mean so far for display
+
+      for (int i=0; i<n; i++) {
+
+        PixelStats &s = stats[ xs[i] + ys[i] * width ];
+
+        if (pass.sample == 0)
+          s.clear();
+
+        s.add( colours[i] );
+
+        colours[i] = s.colour();
+      }
+
+      toRGBA8( colours, blockPixels, n );
+
+      // Fill each pixel's block
+
+      for (int i=0; i<n; i++)
+        for (int y=ys[i]; y<MIN( ys[i]+step, tile.y1 ); y++)
+          for (int x=xs[i]; x<MIN( xs[i]+step, tile.x1 ); x++)
+            pixels[ (x-tile.x0) + (y-tile.y0) * tileWidth ] = blockPixels[i];
+    }
+}
+
+
+// Block until at least one more tile is done, the render is finished,
+// or 'maxSeconds' have passed.  Returns the number of tiles done so far.
+
+int TileRenderer::waitForTiles( float maxSeconds )
+
+{
+  std::unique_lock<std::mutex> lock( progressLock );
+
+  int prevDone = numTilesDone;
+
+  progressCond.wait_for( lock, std::chrono::duration<float>( maxSeconds ),
+                         [&]() { return numTilesDone != prevDone || numTilesDone == passes.size() * tiles.size(); } );
+
+  return numTilesDone;
+}
+
+
+// Fraction of tiles done, over all passes
+
+float TileRenderer::progress()
+
+{
+  std::lock_guard<std::mutex> lock( progressLock );
+
+  if (tiles.size() == 0)
+    return 1;
+
+  return numTilesDone / (float) (passes.size() * tiles.size());
+}
+
+
+// Add the tiles that have changed since the last call to
+// takeDirtyTiles(), copy their pixels into 'displayImage' (which has
+// the image's size), and mark them clean.  All tiles are dirty when a
+// render starts.
+
+void TileRenderer::takeDirtyTiles( seq<Tile> &dirtyTiles, RGBA8 *displayImage )
+
+{
+  std::lock_guard<std::mutex> lock( progressLock );
+
+  for (int i=0; i<tiles.size(); i++)
+    if (tiles[i].dirty) {
+
+      Tile &t = tiles[i];
+
+      for (int y=t.y0; y<t.y1; y++)
+        memcpy( &displayImage[ t.x0 + y * width ], &image[ t.x0 + y * width ], (t.x1 - t.x0) * sizeof(RGBA8) );
+
+      dirtyTiles.add( t );
+      t.dirty = false;
+    }
+}
+
+
+// Number of passes completely done
+
+int TileRenderer::passesDone()
+
+{
+  std::lock_guard<std::mutex> lock( progressLock );
+
+  if (tiles.size() == 0)
+    return passes.size();
+
+  return numTilesDone / tiles.size();
+}
+
+
+bool TileRenderer::finished()
+
+{
+  std::lock_guard<std::mutex> lock( progressLock );
+
+  return numTilesDone == passes.size() * tiles.size();
+}
@@ -0,0 +1,142 @@
+// tileRenderer.h
+//
+// Multithreaded, tile-based ray tracing of the scene.
+//
+// The image is split into TILE_SIZE x TILE_SIZE tiles which are
+// traced by a pool of worker threads.  All progress state is kept
+// here, so the GL thread only has to start a render, check on its
+// progress, and cancel the render when the viewpoint changes.  The GL
+// thread never waits on the workers while a render is in progress: a
+// cancellation is only a request, which the workers act on after
+// their current block of pixels (see requestCancel() and idle()).
+//
+// The image is double buffered.  Each worker traces a tile into its
+// own buffer and copies the finished tile into the image under
+// 'progressLock', marking the tile as dirty.  The GL thread copies the
+// dirty tiles out of the image, under the same lock, into the image
+// that it displays (see takeDirtyTiles()).  So the display only ever
+// shows whole tiles, and the GL thread can upload and draw its copy
+// while the workers go on tracing.
+//
+// An interactive render is progressive: it is traced in several
+// passes over all tiles, each of which improves on the last, so that
+// a useful image is shown soon after the viewpoint changes.  The
+// first passes trace the first sample of one pixel in each 8 x 8, then
+// 4 x 4, then 2 x 2 block and fill the block with its colour, until
+// each pixel has been traced once.  The later passes each add one
+// more sample of every pixel that needs it (see
+// Scene::needsMoreSamples()) to an accumulation buffer.  After the
+// last pass, the image is the same as from a single full-quality pass.
+
+
+#ifndef TILE_RENDERER_H
+#define TILE_RENDERER_H
+
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+#include "linalg.h"
+#include "seq.h"
+#include "pixelStats.h"
+#include "rgba8.h"
+
+
+class Scene;
+
+
+#define TILE_SIZE 32            // tile width and height, in pixels
+#define PIXEL_BLOCK_SIZE 4      // a tile's pixels are traced in blocks this wide and high (see Scene::blockColours())
+#define PROGRESSIVE_BLOCK_SIZE 8 // pixels per block, in each dimension, in the first progressive pass (<= TILE_SIZE)
+
+
+class Tile {
+
+ public:
+
+  int x0, y0;                   // lower-left pixel (inclusive)
+  int x1, y1;                   // upper-right pixel (exclusive)
+  bool dirty;                   // changed since the last takeDirtyTiles()
+
+  Tile() {}
+
+  Tile( int _x0, int _y0, int _x1, int _y1 ) {
+    x0 = _x0; y0 = _y0;
+    x1 = _x1; y1 = _y1;
+    dirty = true;
+  }
+};
+
+
+// One pass over all tiles of the image
+
+class Pass {
+
+ public:
+
+  int blockSize;                // each traced pixel fills a blockSize x blockSize block
+  int sample;                   // the sample traced in each pixel (ALL_SAMPLES for a full-quality pass)
+
+  Pass() {}
+
+  Pass( int _blockSize, int _sample ) {
+    blockSize = _blockSize;
+    sample = _sample;
+  }
+};
+
+#define ALL_SAMPLES -1
+
+
+class TileRenderer {
+
+  Scene *scene;
+
+  seq<Tile>          tiles;            // tiles of the current image
+  seq<Pass>          passes;           // passes over the tiles
+  std::atomic<int>   nextTile;         // index of the next tile to be handed to a worker, over all passes
+  std::atomic<bool>  cancelled;        // set to make the workers stop early
+  std::atomic<int>   numWorkersRunning; // workers that haven't yet left workerLoop()
+
+  PixelStats *stats;            // samples traced so far at each pixel (progressive renders only)
+  int         statsSize;
+
+  seq<std::thread*>  workers;
+
+  std::mutex              progressLock;  // protects numTilesDone, the tiles' 'dirty' flags, and the image
+  std::condition_variable progressCond;  // signalled each time a tile is done
+  int                     numTilesDone;  // tiles done, over all passes
+
+  void workerLoop();
+  void traceTile( Tile &tile, RGBA8 *pixels );
+  void traceTilePass( Tile &tile, Pass &pass, RGBA8 *pixels );
+  bool finishTile( Tile &tile, RGBA8 *pixels );
+
+ public:
+
+  RGBA8 *image;                 // image being written (owned by the caller)
+  int   width, height;          // image dimensions
+
+  TileRenderer( Scene *s );
+
+  ~TileRenderer() {
+    cancel();
+    delete [] stats;
+  }
+
+  void  start( RGBA8 *image, int width, int height, int numThreads, bool progressive );
+  void  cancel();
+  void  requestCancel();
+  bool  idle();
+  int   waitForTiles( float maxSeconds );
+
+  float progress();
+  int   passesDone();
+  void  takeDirtyTiles( seq<Tile> &dirtyTiles, RGBA8 *displayImage );
+  bool  finished();
+};
+
+
+#endif
@@ -26,6 +26,13 @@ class Triangle : public Object {
   bool rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam,
 	       vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, float &intParam, Material *&mat, int &intPartIndex );
 
+  BBox bbox() {
+    BBox b( verts[0].position, verts[0].position );
+    b.expand( verts[1].position );
+    b.expand( verts[2].position );
+    return b;
+  }
+
   Vertex verts[3];		// three vertices of the triangle
   void input( istream &stream );
   void output( ostream &stream ) const;
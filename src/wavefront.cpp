@@ -9,12 +9,15 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <cctype>
+#include <thread>
 
 #ifdef HAVE_PNG
   #include <png.h>
 #endif
 
 #include "wavefront.h"
+#include "mappedFile.h"
 
 
 bool wfModel::newGroupWithNewMaterial = false;
@@ -24,288 +27,687 @@ unsigned char wfMaterial::defaultTexmap[] = { 255, 255, 255, 255, 255, 255,
                                               255, 255, 255, 255, 255, 255 };
 
 
-/* Read a Wavefront model into this structure.  See ObjectFile.html
- * for a description of the Wavefront file format.  This code is from
- * the Nate Robins GLM library.
+/* A tokenizer for a Wavefront file that is mapped into memory.  It
+ * parses in place, with no copying or allocation except of the few
+ * names (of materials and groups) that are returned as tokens.
  */
 
-void wfModel::read( const char *filename )
+static double powersOf10[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                               1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                               1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 }; // (all exact in a double)
 
-{
-  FILE* file;
-  char  buf[1000];
-  float x, y, z;
-  wfGroup    *currentGroup;
-  wfMaterial *currentMaterial;
-  int   nextGroupNum = 0;
+class wfScanner {
 
-  // Counts of different vertex formats
+  const char *p;		/* next character */
+  const char *end;		/* one past the last character */
 
-  int numVTN = 0;
-  int numVT = 0;
-  int numVN = 0;
-  int numV = 0;
+ public:
 
-  /* init */
+  int lineNum;			/* number of newlines passed */
 
-  vertices.clear();
-  normals.clear();
-  texcoords.clear();
-  facetnorms.clear();
-  materials.clear();
-  groups.clear();
+  wfScanner( const char *start, const char *_end ) {
+    p = start;
+    end = _end;
+    lineNum = 0;
+  }
 
-  pathname = strdup(filename);
+  bool atEnd() {
+    return p == end;
+  }
 
-  groups.add( new wfGroup( "default" ) );
-  currentGroup = groups[0];
+  /* Skip spaces on this line */
 
-  materials.add( new wfMaterial( "default" ) );
-  currentMaterial = materials[0];
+  void skipBlanks() {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+      p++;
+  }
 
-  currentGroup->material = currentMaterial;
+  /* Skip spaces and newlines */
 
-  /* open the file */
+  void skipWhitespace() {
+    while (p < end && isspace( (unsigned char) *p )) {
+      if (*p == '\n')
+        lineNum++;
+      p++;
+    }
+  }
 
-  file = fopen(filename, "r");
-  if (!file) {
-    cerr << "wfModel::read() failed: can't open data file '" << filename << "'." << endl;
-    exit(-1);
+  void skipLine() {
+    while (p < end && *p != '\n')
+      p++;
+    if (p < end) {
+      p++;
+      lineNum++;
+    }
   }
 
-  /* process each line */
+  /* Copy the next token on this line into buff.  Returns false if
+   * there are no more on this line.
+   */
 
-  lineNum = 0;
+  bool token( char *buff, int buffSize ) {
+    skipBlanks();
+    int n = 0;
+    while (p < end && !isspace( (unsigned char) *p )) {
+      if (n < buffSize-1)
+        buff[n++] = *p;
+      p++;
+    }
+    buff[n] = '\0';
+    return n > 0;
+  }
 
-  while(fscanf(file, "%s", buf) != EOF) {
+  /* Read an integer on this line */
+
+  bool readInt( int &val ) {
+    skipBlanks();
+    const char *s = p;
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+'))
+      negative = (*s++ == '-');
+    if (s == end || !isdigit( (unsigned char) *s ))
+      return false;
+    int v = 0;
+    while (s < end && isdigit( (unsigned char) *s ))
+      v = 10*v + (*s++ - '0');
+    val = (negative ? -v : v);
+    p = s;
+    return true;
+  }
 
-    lineNum++;
+  /* Read a float on this line.  Up to 19 significant digits are
+   * accumulated in an integer, which is then scaled by an exact power
+   * of ten.  Anything else (a very large exponent, or a nan or inf) is
+   * left to strtod().
+   */
 
-    if (strncmp( buf, "transform", 9 ) == 0) {
+  bool readFloat( float &val ) {
+    skipBlanks();
+    const char *s = p;
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+'))
+      negative = (*s++ == '-');
+
+    unsigned long long mantissa = 0;
+    int numDigits = 0;		/* significant digits in mantissa */
+    int exponent = 0;
+    bool anyDigits = false;
+
+    for (; s < end && isdigit( (unsigned char) *s ); s++) {
+      anyDigits = true;
+      if (numDigits < 19) {
+        mantissa = 10*mantissa + (*s - '0');
+        if (mantissa != 0)
+          numDigits++;
+      } else
+        exponent++;
+    }
 
-      for (int r=0; r<4; r++)
-        for (int c=0; c<4; c++) {
-          float val;
-          fscanf( file, "%f", &val );
-          objToWorldTransform[r][c] = val;
+    if (s < end && *s == '.')
+      for (s++; s < end && isdigit( (unsigned char) *s ); s++) {
+        anyDigits = true;
+        if (numDigits < 19) {
+          mantissa = 10*mantissa + (*s - '0');
+          if (mantissa != 0)
+            numDigits++;
+          exponent--;
         }
+      }
 
-    } else {
+    if (!anyDigits)
+      return readOtherFloat( val );
+
+    if (s < end && (*s == 'e' || *s == 'E')) {
+      const char *e = s+1;
+      bool negativeExp = false;
+      if (e < end && (*e == '-' || *e == '+'))
+        negativeExp = (*e++ == '-');
+      if (e < end && isdigit( (unsigned char) *e )) {
+        int x = 0;
+        for (; e < end && isdigit( (unsigned char) *e ); e++)
+          if (x < 10000)
+            x = 10*x + (*e - '0');
+        exponent += (negativeExp ? -x : x);
+        s = e;
+      }
+    }
 
-      int v = 0, n = 0, t = 0;
-      wfTriangle *tri, *prevTri;
+    if (mantissa >= (1ULL << 53) || exponent < -22 || exponent > 22)
+      return readOtherFloat( val );
+
+    double v = (double) mantissa;
+    if (exponent < 0)
+      v /= powersOf10[ -exponent ];
+    else
+      v *= powersOf10[ exponent ];
+
+    val = (float) (negative ? -v : v);
+    p = s;
+    return true;
+  }
+
+  bool readOtherFloat( float &val ) {
+    char buff[100];
+    const char *start = p;
+    if (!token( buff, sizeof(buff) ))
+      return false;
+    char *e;
+    val = strtof( buff, &e );
+    if (e == buff) {
+      p = start;
+      return false;
+    }
+    p = start + (e - buff);
+    return true;
+  }
+
+  /* Read a face vertex, which is one of v, v/t, v//n, or v/t/n.
+   * Absent indices are returned as 0.
+   */
+
+  bool readFaceVertex( int &v, int &t, int &n ) {
+    if (!readInt( v ))
+      return false;
+    t = n = 0;
+    if (p < end && *p == '/') {
+      p++;
+      if (p < end && *p != '/')
+        readInt( t );
+      if (p < end && *p == '/') {
+        p++;
+        readInt( n );
+      }
+    }
+    return true;
+  }
+};
+
+
+
+/* A command that changes the reader's state (the current group,
+ * material, or transform) or that must be reported.  These are
+ * recorded by each chunk so that they can be applied in file order
+ * when the chunks are stitched together.
+ */
+
+enum { WF_MTLLIB, WF_USEMTL, WF_GROUP, WF_TRANSFORM, WF_UNKNOWN };
+
+class wfCommand {
+ public:
+  int   type;
+  int   triIndex;		/* number of the chunk's triangles before this command */
+  int   lineNum;
+  char *name;			/* material, group, or library name (or the unknown command) */
+  float matrix[16];		/* transform */
+};
+
+
+/* A range of lines of a Wavefront file, which is parsed separately
+ * from the other ranges.
+ *
+ * Each chunk is parsed in two passes.  The first counts the vertices,
+ * normals, and texcoords in the chunk.  The prefix sums of those give
+ * the number before each chunk, with which the second pass resolves
+ * all face indices, including relative (negative) ones, to indices
+ * in the whole model.
+ */
+
+#define WF_MIN_CHUNK_SIZE (4 << 20) // bytes; smaller files are read by one thread
+
+class wfChunk {
+
+ public:
+
+  const char *start, *end;
+
+  int firstLine;		/* number of lines before this chunk */
+  int numLines;
+
+  int numVertices, numNormals, numTexcoords; /* in this chunk */
+  int vertexBase, normalBase, texcoordBase;  /* in all earlier chunks */
+
+  seq<vec3>       vertices;
+  seq<vec3>       normals;
+  seq<vec3>       texcoords;
+  seq<wfTriangle> triangles;
+  seq<wfCommand>  commands;
+
+  int numVTN, numVT, numVN, numV; /* counts of faces in each vertex format */
+
+  wfChunk( const char *s, const char *e ) {
+    start = s;
+    end = e;
+    firstLine = numLines = 0;
+    numVertices = numNormals = numTexcoords = 0;
+    vertexBase = normalBase = texcoordBase = 0;
+    numVTN = numVT = numVN = numV = 0;
+  }
+
+  void count();
+  void parse();
+
+  int faceIndex( int i, int base, int numSoFar );
+  void addCommand( int type, int lineNum, const char *name );
+};
+
+
+/* First pass: count lines, vertices, normals, and texcoords.  A line
+ * is classified by its first token, as in parse().
+ */
+
+void wfChunk::count()
+
+{
+  const char *p = start;
+
+  while (p < end) {
+
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+      p++;
+
+    if (p < end && p[0] == 'v') {
+      if (p+1 == end || isspace( (unsigned char) p[1] ))
+        numVertices++;
+      else if (p[1] == 'n')
+        numNormals++;
+      else if (p[1] == 't')
+        numTexcoords++;
+    }
+
+    p = (const char *) memchr( p, '\n', end - p );
+    if (p == NULL)
+      break;
+    p++;
+    numLines++;
+  }
+}
+
+
+/* Resolve a face index for an array which has 'base' elements in
+ * earlier chunks and 'numSoFar' in this chunk before the face.
+ * Returns the 0-based index, or -1 if the index is absent (0).
+ */
+
+int wfChunk::faceIndex( int i, int base, int numSoFar )
+
+{
+  if (i > 0)
+    return i-1;
+  else if (i < 0)
+    return base + numSoFar + i;
+  else
+    return -1;
+}
+
+
+void wfChunk::addCommand( int type, int lineNum, const char *name )
+
+{
+  wfCommand c;
+
+  c.type = type;
+  c.triIndex = triangles.size();
+  c.lineNum = lineNum;
+  c.name = (name == NULL ? NULL : strdup( name ));
+
+  commands.add( c );
+}
+
+
+/* Second pass: parse the chunk's lines */
+
+void wfChunk::parse()
+
+{
+  char  buf[1000];
+  float x, y, z;
+
+  wfScanner in( start, end );
+
+  while (true) {
+
+    in.skipWhitespace();
+
+    if (in.atEnd())
+      break;
+
+    int lineNum = firstLine + in.lineNum + 1;
+
+    in.token( buf, sizeof(buf) );
+
+    if (strncmp( buf, "transform", 9 ) == 0) {
+
+      addCommand( WF_TRANSFORM, lineNum, NULL );
+
+      wfCommand &c = commands[ commands.size()-1 ];
+
+      for (int i=0; i<16; i++) {
+        c.matrix[i] = 0;
+        in.skipWhitespace();	/* (the matrix is usually on the following lines) */
+        in.readFloat( c.matrix[i] );
+      }
+
+    } else {
 
       switch(buf[0]) {
 
       case '#':                         /* comment */
-        /* eat up rest of line */
-        fgets(buf, sizeof(buf), file);
-        break;
-
       case 's':                         /* smoothing group ... ignore */
-        /* eat up rest of line */
-        fgets(buf, sizeof(buf), file);
         break;
 
       case 'v':                         /* v, vn, vt */
         switch(buf[1]) {
 
         case '\0':                      /* vertex */
-          fscanf(file, "%f %f %f", &x, &y, &z );
+          x = y = z = 0;
+          in.readFloat( x ); in.readFloat( y ); in.readFloat( z );
           vertices.add( vec3(x,y,z) );
           break;
 
         case 'n':                               /* normal */
-          fscanf(file, "%f %f %f", &x, &y, &z );
+          x = y = z = 0;
+          in.readFloat( x ); in.readFloat( y ); in.readFloat( z );
           normals.add( vec3(x,y,z).normalize() );
           break;
 
         case 't':                               /* texcoord */
-          fscanf(file, "%f %f", &x, &y );
+          x = y = 0;
+          in.readFloat( x ); in.readFloat( y );
           texcoords.add( vec3(x,y,0) );
-          fgets(buf, sizeof(buf), file); // skip rest of line
           break;
         }
         break;
 
       case 'm':                         /* mtllib filename */
-        fgets(buf, sizeof(buf), file);
-        sscanf(buf, "%s %s", buf, buf);
-        mtllibname = strdup(buf);
-        readMaterialLibrary( buf );
+        in.token( buf, sizeof(buf) );
+        addCommand( WF_MTLLIB, lineNum, buf );
         break;
 
       case 'u':                         /* usemtl name */
-
-        if (newGroupWithNewMaterial) {
-          char buffer[100];
-          sprintf( buffer, "g%d", nextGroupNum++ );
-          currentGroup = findGroup( buffer );
-        }
-      
-        fgets(buf, sizeof(buf), file);
-        sscanf(buf, "%s %s", buf, buf);
-        currentGroup->material = currentMaterial = findMaterial( buf );
+        in.token( buf, sizeof(buf) );
+        addCommand( WF_USEMTL, lineNum, buf );
         break;
 
       case 'g':                         /* group */
-        /* eat up rest of line */
-        fgets(buf, sizeof(buf), file);
-        sscanf(buf, "%s", buf);
-        if (buf[0] == '\n')
-          currentGroup = findGroup( "default" );
+        if (!in.token( buf, sizeof(buf) ))
+          addCommand( WF_GROUP, lineNum, "default" );
         else
-          currentGroup = findGroup( buf );
-        currentGroup->material = currentMaterial;
+          addCommand( WF_GROUP, lineNum, buf );
+        break;
+
+      case 'f': {                       /* face */
+
+        /* Each vertex can be one of v, v//n, v/t, or v/t/n.  The
+         * first three vertices define a triangle.  More vertices (a
+         * convex polygon) are converted to a fan of triangles.
+         */
+
+        wfTriangle tri;
+        int v, t, n;
+        int numVerts = 0;
+
+        while (in.readFaceVertex( v, t, n )) {
+
+          if (numVerts == 0) {
+            if (t != 0 && n != 0)
+              numVTN++;
+            else if (n != 0)
+              numVN++;
+            else if (t != 0)
+              numVT++;
+            else
+              numV++;
+          }
+
+          v = faceIndex( v, vertexBase, vertices.size() );
+          wfModel::checkVindex( v, vertexBase + vertices.size(), lineNum );
+
+          t = faceIndex( t, texcoordBase, texcoords.size() );
+          n = faceIndex( n, normalBase, normals.size() );
+
+          if (numVerts < 3) {
+            tri.vindices[numVerts] = v;
+            tri.tindices[numVerts] = t;
+            tri.nindices[numVerts] = n;
+          } else {
+            tri.vindices[1] = tri.vindices[2];
+            tri.tindices[1] = tri.tindices[2];
+            tri.nindices[1] = tri.nindices[2];
+            tri.vindices[2] = v;
+            tri.tindices[2] = t;
+            tri.nindices[2] = n;
+          }
+
+          if (numVerts >= 2)
+            triangles.add( tri );
+
+          numVerts++;
+        }
+        break;
+      }
+
+      default:
+        addCommand( WF_UNKNOWN, lineNum, buf );
         break;
+      }
+    }
 
-      case 'f':                         /* face */
+    if (!in.atEnd())
+      in.skipLine();		/* ignore anything else on the line */
+  }
+}
 
-        fscanf(file, "%s", buf);
 
-        /* can be one of %d, %d//%d, %d/%d, or %d/%d/%d */
+/* Split a file into chunks of whole lines for parsing in parallel.
+ * Each chunk after the first starts at a 'v' or 'f' line, so that no
+ * command (like a transform, which continues onto the following
+ * lines) is split between chunks.
+ */
 
-        tri = new wfTriangle();
+static void splitIntoChunks( const char *start, const char *end, seq<wfChunk*> &chunks )
 
-        if (strstr(buf, "//")) {        /* v//n */
+{
+  int numChunks = MIN( (int) std::thread::hardware_concurrency(), (int) ((end - start) / WF_MIN_CHUNK_SIZE) );
+  size_t chunkSize = (end - start) / MAX( 1, numChunks );
 
-          numVN++;
+  const char *chunkStart = start;
 
-          /* First three vertices define a triangle */
+  for (int i=1; i<numChunks; i++) {
 
-          sscanf(buf, "%d//%d", &v, &n);        v--; checkVindex(v); n--; tri->vindices[0] = v; tri->nindices[0] = n;
-          fscanf(file, "%d//%d", &v, &n);       v--; checkVindex(v); n--; tri->vindices[1] = v; tri->nindices[1] = n;
-          fscanf(file, "%d//%d", &v, &n);       v--; checkVindex(v); n--; tri->vindices[2] = v; tri->nindices[2] = n;
+    const char *p = MAX( chunkStart, start + i * chunkSize );
 
-          currentGroup->triangles.add( tri );
+    while (p < end) {
+      p = (const char *) memchr( p, '\n', end - p );
+      if (p == NULL) {
+        p = end;
+        break;
+      }
+      p++;
+      if (p < end && (*p == 'v' || *p == 'f'))
+        break;
+    }
 
-          /* More vertices (a convex polygon) are converted to a fan of triangles: */
+    if (p >= end)
+      break;
 
-          while(fscanf(file, "%d//%d", &v, &n) > 0) {
+    chunks.add( new wfChunk( chunkStart, p ) );
+    chunkStart = p;
+  }
 
-            v--; checkVindex(v); n--;
+  chunks.add( new wfChunk( chunkStart, end ) );
+}
 
-            prevTri = tri;
-            tri = new wfTriangle();
 
-            tri->vindices[0] = prevTri->vindices[0];
-            tri->nindices[0] = prevTri->nindices[0];
-            tri->vindices[1] = prevTri->vindices[2];
-            tri->nindices[1] = prevTri->nindices[2];
-            tri->vindices[2] = v;
-            tri->nindices[2] = n;
+/* Run one pass over all chunks, with a thread per chunk */
 
-            currentGroup->triangles.add( tri );
-          }
-        
-        } else if (sscanf(buf, "%d/%d/%d", &v, &t, &n) == 3) {  /* v/t/n */
+static void runOnChunks( seq<wfChunk*> &chunks, void (wfChunk::*pass)() )
 
-          numVTN++;
+{
+  if (chunks.size() == 1) {
+    (chunks[0]->*pass)();
+    return;
+  }
 
-          v--; checkVindex(v); n--; t--;
+  seq<std::thread*> threads;
 
-          tri->vindices[0] = v;
-          tri->tindices[0] = t;
-          tri->nindices[0] = n;
-          fscanf(file, "%d/%d/%d", &v, &t, &n); v--; checkVindex(v); n--; t--;
-          tri->vindices[1] = v;
-          tri->tindices[1] = t;
-          tri->nindices[1] = n;
-          fscanf(file, "%d/%d/%d", &v, &t, &n); v--; checkVindex(v); n--; t--;
-          tri->vindices[2] = v;
-          tri->tindices[2] = t;
-          tri->nindices[2] = n;
+  for (int i=0; i<chunks.size(); i++)
+    threads.add( new std::thread( pass, chunks[i] ) );
 
-          currentGroup->triangles.add( tri );
-        
-          while(fscanf(file, "%d/%d/%d", &v, &t, &n) > 0) {
+  for (int i=0; i<threads.size(); i++) {
+    threads[i]->join();
+    delete threads[i];
+  }
+}
 
-            v--; checkVindex(v); n--; t--;
 
-            prevTri = tri;
-            tri = new wfTriangle();
 
-            tri->vindices[0] = prevTri->vindices[0];
-            tri->tindices[0] = prevTri->tindices[0];
-            tri->nindices[0] = prevTri->nindices[0];
-            tri->vindices[1] = prevTri->vindices[2];
-            tri->tindices[1] = prevTri->tindices[2];
-            tri->nindices[1] = prevTri->nindices[2];
-            tri->vindices[2] = v;
-            tri->tindices[2] = t;
-            tri->nindices[2] = n;
+/* Read a Wavefront model into this structure.  See ObjectFile.html
+ * for a description of the Wavefront file format.  This was
+ * originally the Nate Robins GLM library's reader.
+ *
+ * The file is mapped into memory and parsed in place.  Large files
+ * are split into chunks which are parsed in parallel (see wfChunk),
+ * and the chunks' results are then concatenated in file order, so
+ * that the model is the same as if it had been read serially.
+ *
+ * Triangles are stored by value in each group's array, and polygons
+ * are split into fans of triangles.
+ */
 
-            currentGroup->triangles.add( tri );
-          }
-        
-        } else if (sscanf(buf, "%d/%d", &v, &t) == 2) { /* v/t */
+void wfModel::read( const char *filename )
+
+{
+  wfGroup    *currentGroup;
+  wfMaterial *currentMaterial;
+  int   nextGroupNum = 0;
+
+  // Counts of different vertex formats
+
+  int numVTN = 0;
+  int numVT = 0;
+  int numVN = 0;
+  int numV = 0;
+
+  /* init */
 
-          numVT++;
+  vertices.clear();
+  normals.clear();
+  texcoords.clear();
+  facetnorms.clear();
+  materials.clear();
+  groups.clear();
 
-          v--; checkVindex(v); t--;
+  pathname = strdup(filename);
 
-          tri->vindices[0] = v;
-          tri->tindices[0] = t;
-          fscanf(file, "%d/%d", &v, &t);        v--; checkVindex(v); t--;
-          tri->vindices[1] = v;
-          tri->tindices[1] = t;
-          fscanf(file, "%d/%d", &v, &t);        v--; checkVindex(v); t--;
-          tri->vindices[2] = v;
-          tri->tindices[2] = t;
+  groups.add( new wfGroup( "default" ) );
+  currentGroup = groups[0];
 
-          currentGroup->triangles.add( tri );
+  materials.add( new wfMaterial( "default" ) );
+  currentMaterial = materials[0];
 
-          while(fscanf(file, "%d/%d", &v, &t) > 0) {
+  currentGroup->material = currentMaterial;
 
-            v--; checkVindex(v); t--;
+  /* open the file */
 
-            prevTri = tri;
-            tri = new wfTriangle();
+  MappedFile file;
 
-            tri->vindices[0] = prevTri->vindices[0];
-            tri->tindices[0] = prevTri->tindices[0];
-            tri->vindices[1] = prevTri->vindices[2];
-            tri->tindices[1] = prevTri->tindices[2];
-            tri->vindices[2] = v;
-            tri->tindices[2] = t;
+  if (!file.open( filename )) {
+    cerr << "wfModel::read() failed: can't open data file '" << filename << "'." << endl;
+    exit(-1);
+  }
 
-            currentGroup->triangles.add( tri );
-          }
-        
-        } else {        /* v */
-        
-          numV++;
+  /* parse the chunks */
 
-          sscanf(buf, "%d", &v); v--; checkVindex(v);
-          tri->vindices[0] = v;
-          fscanf(file, "%d", &v); v--; checkVindex(v);
-          tri->vindices[1] = v;
-          fscanf(file, "%d", &v); v--; checkVindex(v);
-          tri->vindices[2] = v;
+  seq<wfChunk*> chunks;
 
-          currentGroup->triangles.add( tri );
-        
-          while(fscanf(file, "%d", &v) > 0) {
+  splitIntoChunks( file.data, file.end(), chunks );
 
-            v--; checkVindex(v);
+  runOnChunks( chunks, &wfChunk::count );
 
-            prevTri = tri;
-            tri = new wfTriangle();
+  for (int i=1; i<chunks.size(); i++) {
+    wfChunk &prev = *chunks[i-1];
+    chunks[i]->firstLine    = prev.firstLine    + prev.numLines;
+    chunks[i]->vertexBase   = prev.vertexBase   + prev.numVertices;
+    chunks[i]->normalBase   = prev.normalBase   + prev.numNormals;
+    chunks[i]->texcoordBase = prev.texcoordBase + prev.numTexcoords;
+  }
+
+  runOnChunks( chunks, &wfChunk::parse );
+
+  /* stitch the chunks together, applying their commands in order */
+
+  wfChunk &last = *chunks[chunks.size()-1];
+  vertices.reserve( vertices.size() + last.vertexBase + last.numVertices );
+  normals.reserve( normals.size() + last.normalBase + last.numNormals );
+  texcoords.reserve( texcoords.size() + last.texcoordBase + last.numTexcoords );
+
+  for (int i=0; i<chunks.size(); i++) {
+
+    wfChunk &chunk = *chunks[i];
+
+    for (int j=0; j<chunk.vertices.size(); j++)
+      vertices.add( chunk.vertices[j] );
+
+    for (int j=0; j<chunk.normals.size(); j++)
+      normals.add( chunk.normals[j] );
+
+    for (int j=0; j<chunk.texcoords.size(); j++)
+      texcoords.add( chunk.texcoords[j] );
+
+    int nextCommand = 0;
 
-            tri->vindices[0] = prevTri->vindices[0];
-            tri->vindices[1] = prevTri->vindices[2];
-            tri->vindices[2] = v;
+    for (int j=0; j<=chunk.triangles.size(); j++) {
 
-            currentGroup->triangles.add( tri );
+      for (; nextCommand < chunk.commands.size() && chunk.commands[nextCommand].triIndex == j; nextCommand++) {
+
+        wfCommand &c = chunk.commands[nextCommand];
+
+        switch (c.type) {
+
+        case WF_MTLLIB:
+          mtllibname = c.name;
+          readMaterialLibrary( c.name );
+          c.name = NULL;	/* (kept as mtllibname) */
+          break;
+
+        case WF_USEMTL:
+          if (newGroupWithNewMaterial) {
+            char buffer[100];
+            sprintf( buffer, "g%d", nextGroupNum++ );
+            currentGroup = findGroup( buffer );
           }
+          currentGroup->material = currentMaterial = findMaterial( c.name );
+          break;
+
+        case WF_GROUP:
+          currentGroup = findGroup( c.name );
+          currentGroup->material = currentMaterial;
+          break;
+
+        case WF_TRANSFORM:
+          for (int r=0; r<4; r++)
+            for (int col=0; col<4; col++)
+              objToWorldTransform[r][col] = c.matrix[4*r+col];
+          break;
+
+        case WF_UNKNOWN:
+          cerr << "Warning: unrecognized Wavefront command on line " << c.lineNum << ": " << c.name << endl;
+          break;
         }
-        break;
 
-      default:
-        cerr << "Warning: unrecognized Wavefront command on line " << lineNum << ": " << buf << endl;
-        break;
+        free( c.name );
       }
+
+      if (j < chunk.triangles.size())
+        currentGroup->triangles.add( chunk.triangles[j] );
     }
+
+    numVTN += chunk.numVTN;
+    numVT  += chunk.numVT;
+    numVN  += chunk.numVN;
+    numV   += chunk.numV;
+
+    delete chunks[i];
   }
 
   // Determine a consistent format for each vertex
@@ -315,20 +717,18 @@ void wfModel::read( const char *filename )
 
   // Apply transform to all vertices
 
-  for (int i=0; i<vertices.size(); i++)
-    vertices[i] = (objToWorldTransform * vec4( vertices[i], 1.0 )).toVec3();
+  transformPoints( objToWorldTransform, vertices.array(), vertices.array(), vertices.size() );
 
   // Apply transform to all normals
 
-  for (int i=0; i<normals.size(); i++)
-    normals[i] = (objToWorldTransform * vec4( normals[i], 0.0 )).toVec3();
+  transformDirections( objToWorldTransform, normals.array(), normals.array(), normals.size() );
 
   // Compute all face normals
 
   for (int g=0; g<groups.size(); g++)
     for (int i=0; i<groups[g]->triangles.size(); i++) {
 
-      wfTriangle &tri = *groups[g]->triangles[i];
+      wfTriangle &tri = groups[g]->triangles[i];
 
       vec3 d01 = vertices[ tri.vindices[1] ] - vertices[ tri.vindices[0] ];
       vec3 d02 = vertices[ tri.vindices[2] ] - vertices[ tri.vindices[0] ];
@@ -380,22 +780,7 @@ void wfModel::readMaterialLibrary( const char *name )
   wfMaterial *currentMaterial;
   int i;
  
-  /* open the file */
-
-  char *dir = new char[ strlen( pathname )+1 ];
-
-  strcpy( dir, pathname );
-
-  char *s = strrchr(dir, '/');
-  if (s)
-    s[1] = '\0';
-  else
-    dir[0] = '\0';
-
-  char *filename = new char[ strlen(dir) + strlen(name) + 1 ];
-
-  strcpy(filename, dir);
-  strcat(filename, name);
+  char *filename = pathInModelDir( name );
 
   /* open the file */
 
@@ -494,7 +879,14 @@ void wfModel::readMaterialLibrary( const char *name )
                 &currentMaterial->ambient[1],
                 &currentMaterial->ambient[2]);
         break;
-        
+
+      case 'e':
+        fscanf( file, "%f %f %f",
+                &currentMaterial->emissive[0],
+                &currentMaterial->emissive[1],
+                &currentMaterial->emissive[2] );
+        break;
+
       default:
         /* eat up rest of line */
         fgets(buf, sizeof(buf), file);
@@ -507,24 +899,13 @@ void wfModel::readMaterialLibrary( const char *name )
       sscanf(buf, "%s %s", buf, buf);
 
       {
-        // prepend path to the directory of the model file
-
-        char *dir = new char[ strlen(pathname)+1 ];
-        strcpy( dir, pathname );
-
-        char *s = strrchr(dir, '/');
-        if (s != NULL) s[1] = '\0'; else dir[0] = '\0';
-
-        char *filename = new char[ strlen(dir) + strlen(buf) + 1 ];
-
-        strcpy(filename, dir);
-        strcat(filename, buf);
+        char *filename = pathInModelDir( buf );
 
         // load the texture
 
         currentMaterial->loadTexmap( filename );
+        currentMaterial->texmapName = strdup( buf );
 
-        delete [] dir;
         delete [] filename;
       }
 
@@ -536,11 +917,29 @@ void wfModel::readMaterialLibrary( const char *name )
       break;
     }
   }
-  delete [] dir;
   delete [] filename;
 }
 
 
+/* Prepend the directory of the model file to a filename.  The caller
+ * deletes the result.
+ */
+
+char *wfModel::pathInModelDir( const char *name )
+
+{
+  const char *s = strrchr( pathname, '/' );
+  int dirLength = (s == NULL ? 0 : s+1 - pathname);
+
+  char *filename = new char[ dirLength + strlen(name) + 1 ];
+
+  strncpy( filename, pathname, dirLength );
+  strcpy( filename + dirLength, name );
+
+  return filename;
+}
+
+
 /* read a ppm texture map into the material
  */
 
@@ -605,52 +1004,99 @@ public:
 };
 
 
+/* A hash table from vertex signatures to vertex indices, with open
+ * addressing and linear probing.  It is sized for at most 'maxSize'
+ * entries and never grows.
+ */
 
-void wfModel::setupVAO( TextureMode textureMode )
+#define NO_VERTEX 0xffffffff
 
-{
-  // Note that positions, normals, and texture coordinates can all be
-  // indexed differently in a Wavefront file.  But OpenGL permits only
-  // one index per vertex, and the OpenGL vertex encapsulates all
-  // attributes, including position, normal, and texture coordinates.
-  //
-  // So we have to create *another* array of vertices where each
-  // vertex stores position, normal, and texture coordinates and the
-  // face indices index into this new array.
+class VertexSignatureTable {
 
-  unsigned int vertexSize = 3;
+  VertexSignature *keys;
+  unsigned int    *values;	/* NO_VERTEX for an empty slot */
+  unsigned int     mask;	/* table size - 1 (the size is a power of two) */
 
-  if (hasVertexNormals || true)	// always have a normal for the shader, even if not provided
-    vertexSize += 3;
+  static unsigned int hash( VertexSignature &vs ) {
+    unsigned int h = vs.sig[0] * 0x9e3779b1;
+    h = (h ^ (h >> 15) ^ vs.sig[1]) * 0x85ebca77;
+    h = (h ^ (h >> 13) ^ vs.sig[2]) * 0xc2b2ae3d;
+    return h ^ (h >> 16);
+  }
 
-  if (hasVertexTexCoords || true) // always have texcoords for the shader, even if not provided
-    vertexSize += 2;
+ public:
+
+  VertexSignatureTable( unsigned int maxSize ) {
+    unsigned int size = 16;
+    while (size < 2 * maxSize)	/* at most half full */
+      size *= 2;
+    keys = new VertexSignature[ size ];
+    values = new unsigned int[ size ];
+    for (unsigned int i=0; i<size; i++)
+      values[i] = NO_VERTEX;
+    mask = size-1;
+  }
 
-  // Process each group separately
+  ~VertexSignatureTable() {
+    delete [] keys;
+    delete [] values;
+  }
 
+  /* Return the index stored for 'vs'.  If there is none, store
+   * 'newIndex' for it and return NO_VERTEX.
+   */
+
+  unsigned int findOrAdd( VertexSignature &vs, unsigned int newIndex ) {
+    for (unsigned int i = hash( vs ) & mask; ; i = (i+1) & mask) {
+      if (values[i] == NO_VERTEX) {
+        keys[i] = vs;
+        values[i] = newIndex;
+        return NO_VERTEX;
+      }
+      if (keys[i] == vs)
+        return values[i];
+    }
+  }
+};
+
+
+// Note that positions, normals, and texture coordinates can all be
+// indexed differently in a Wavefront file.  But OpenGL permits only
+// one index per vertex, and the OpenGL vertex encapsulates all
+// attributes, including position, normal, and texture coordinates.
+//
+// So we have to create *another* array of vertices where each vertex
+// stores position, normal, and texture coordinates and the face
+// indices index into this new array.
+//
+// These buffers are built without OpenGL, and are kept in each group
+// only until setupVAO() has uploaded them.
+
+void wfModel::buildVertexBuffers()
+
+{
   for (int i=0; i<groups.size(); i++) {
 
     wfGroup *thisGroup = groups[i];
 
     int numTriangles = thisGroup->triangles.size();
 
-    if (numTriangles > 0) {
+    if (numTriangles > 0 && thisGroup->vertexBuffer == NULL) {
       
-      GLfloat *vertexBuffer = new GLfloat[ numTriangles * 3 * vertexSize ];
+      GLfloat *vertexBuffer = new GLfloat[ numTriangles * 3 * WF_VERTEX_SIZE ];
       GLuint *faceIndexBuffer = new GLuint[ numTriangles * 3 ];
 
       unsigned int nVerts = 0;
-      int nFaces = 0;
 
-      VertexSignature *vertSig = new VertexSignature[ numTriangles * 3 ];
+      VertexSignatureTable vertSigs( numTriangles * 3 );
 
       for (int j=0; j<thisGroup->triangles.size(); j++) {
       
-        wfTriangle *tri = thisGroup->triangles[j];
+        wfTriangle *tri = &thisGroup->triangles[j];
 
         for (int k=0; k<3; k++) {
 
-          // Find an already-stored vertex with this signature (brute force)
+          // Find an already-stored vertex with this signature
 
           VertexSignature vs;
 
@@ -658,41 +1104,62 @@ void wfModel::setupVAO( TextureMode textureMode )
           vs.sig[1] = tri->nindices[k];
           vs.sig[2] = tri->tindices[k];
 
-          unsigned int l;
-          for (l=0; l<nVerts; l++)
-            if (vs == vertSig[l])
-              break;
+          unsigned int l = vertSigs.findOrAdd( vs, nVerts );
+
+          if (l == NO_VERTEX) {    // none found ... create a new vertex
+
+            l = nVerts;
 
-          if (l == nVerts) {    // none found ... create a new vertex
+            GLfloat *v = &vertexBuffer[ nVerts * WF_VERTEX_SIZE ];
 
-            * (vec3*) &vertexBuffer[nVerts*vertexSize] = vertices[ tri->vindices[k] ];
+            * (vec3*) &v[0] = vertices[ tri->vindices[k] ];
 
 	    if (hasVertexNormals)
-              * (vec3*) &vertexBuffer[nVerts*vertexSize+3] = normals[ tri->nindices[k] ];
+              * (vec3*) &v[3] = normals[ tri->nindices[k] ];
 	    else
-              * (vec3*) &vertexBuffer[nVerts*vertexSize+3] = facetnorms[ tri->findex ];
-
-            if (hasVertexTexCoords) {
-              if (hasVertexNormals || true) // alway has vertex normals now
-                * (vec2*) &vertexBuffer[nVerts*vertexSize+6] = * (vec2*) &texcoords[ tri->tindices[k] ];
-              else
-                * (vec2*) &vertexBuffer[nVerts*vertexSize+3] = * (vec2*) &texcoords[ tri->tindices[k] ];
-            }
-          
-            vertSig[ nVerts ] = vs;
+              * (vec3*) &v[3] = facetnorms[ tri->findex ];
 
+            if (hasVertexTexCoords)
+              * (vec2*) &v[6] = * (vec2*) &texcoords[ tri->tindices[k] ];
+          
             nVerts++;
           }
 
           // Store this vertex index
 
-          faceIndexBuffer[ nFaces * 3 + k ] = l;
+          faceIndexBuffer[ j * 3 + k ] = l;
         }
-
-        nFaces++;
       }
 
-      //cout << "stored " << nVerts << " verts, " << nFaces << " faces" << endl;
+      thisGroup->vertexBuffer = vertexBuffer;
+      thisGroup->indexBuffer = faceIndexBuffer;
+      thisGroup->numBufferVertices = nVerts;
+    }
+  }
+}
+
+
+
+void wfModel::setupVAO( TextureMode textureMode )
+
+{
+  buildVertexBuffers();
+
+  unsigned int vertexSize = WF_VERTEX_SIZE; // always have a normal and texcoords for the shader, even if not provided
+
+  // Process each group separately
+
+  for (int i=0; i<groups.size(); i++) {
+
+    wfGroup *thisGroup = groups[i];
+
+    if (thisGroup->vertexBuffer != NULL) {
+
+      GLfloat *vertexBuffer = thisGroup->vertexBuffer;
+      GLuint *faceIndexBuffer = thisGroup->indexBuffer;
+
+      unsigned int nVerts = thisGroup->numBufferVertices;
+      int nFaces = thisGroup->triangles.size();
 
       // Set up the VAO
 
@@ -754,20 +1221,31 @@ void wfModel::setupVAO( TextureMode textureMode )
 
       thisGroup->VAOinitialized = true;
 
-      delete [] vertexBuffer;
-      delete [] faceIndexBuffer;
-      delete [] vertSig;
       glBindVertexArray( 0 );
+
+      // OpenGL has its own copies now
+
+      delete [] thisGroup->vertexBuffer;
+      delete [] thisGroup->indexBuffer;
+
+      thisGroup->vertexBuffer = NULL;
+      thisGroup->indexBuffer = NULL;
+      thisGroup->numBufferVertices = 0;
     }
   }
 
   initTextures( textureMode );
+
+  VAOsSetUp = true;
 }
 
 
 void wfModel::draw( GPUProgram * gpuProg, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS )
 
 {
+  if (!VAOsSetUp)
+    setupVAO( textureMode );
+
   gpuProg->setMat4( "MV",  WCS_to_VCS );
 
   mat4 MVP = VCS_to_CCS * WCS_to_VCS;
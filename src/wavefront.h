@@ -40,6 +40,7 @@ class wfMaterial {
   GLfloat alpha;		/* material property ... not anything to do with the texmap */
 
   GLubyte *texmap;		/* texture map */
+  char    *texmapName;		/* its filename, relative to the model's directory */
   unsigned int width, height;   /* texmap dimensions */
   GLuint  textureID;		/* the OpenGL ID for this texture */
   bool    hasAlpha;		/* texmap has alpha component */
@@ -57,6 +58,7 @@ class wfMaterial {
     alpha = 1.0;
     shininess = 200;
     texmap = NULL;
+    texmapName = NULL;
     textureID = 0;
     width = height = 0;
   }
@@ -93,27 +95,40 @@ class wfTriangle {
 class wfGroup {
  public:
   char             *name;	/* name of this group */
-  seq<wfTriangle*> triangles;	/* triangles of this group */
+  seq<wfTriangle>  triangles;	/* triangles of this group */
   wfMaterial       *material;	/* material for group */
   GLuint           VAO;
   bool             VAOinitialized;
 
+  GLfloat         *vertexBuffer;	/* interleaved vertices until uploaded (see wfModel::buildVertexBuffers()) */
+  GLuint          *indexBuffer;		/* three indices into vertexBuffer per triangle */
+  unsigned int     numBufferVertices;
+
   wfGroup() {}
 
   wfGroup( const char *gname ) {
     name = new char[ strlen(gname)+1 ];
     strcpy( name, gname );
     VAOinitialized = false;
+    vertexBuffer = NULL;
+    indexBuffer = NULL;
+    numBufferVertices = 0;
   }
 
   ~wfGroup() {
     delete [] name;
+    delete [] vertexBuffer;
+    delete [] indexBuffer;
   }
 
   wfGroup( const wfGroup & source ) { // copy constructor
     name = strdup(source.name);
     triangles = source.triangles;
     material = source.material;
+    VAOinitialized = false;
+    vertexBuffer = NULL;
+    indexBuffer = NULL;
+    numBufferVertices = 0;
   }
 
   wfGroup const &operator=( wfGroup const &src ) { // assignment operator
@@ -131,6 +146,9 @@ class wfGroup {
  */
 
 
+#define WF_VERTEX_SIZE 8	/* floats per interleaved vertex: position, normal, texcoords */
+
+
 class wfModel {
 
   const char*    pathname;		/* path to this model */
@@ -146,11 +164,13 @@ class wfModel {
 
   bool texturesInitialized;
 
+  bool        VAOsSetUp;	/* setupVAO() has been called */
+  TextureMode textureMode;	/* texture mode for setupVAO() */
+
   wfMaterial* findMaterial( const char *name );            /* find a named material */
   wfGroup*    findGroup( const char *name );               /* find a named group */
   void        readMaterialLibrary( const char *filename ); /* read all materials */
 
-  int lineNum;
   unsigned int nFaces;
 
   friend class WavefrontObj;
@@ -173,31 +193,45 @@ class wfModel {
 
   wfModel() {
     texturesInitialized = false;
+    VAOsSetUp = false;
+    textureMode = MIPMAP_LINEAR;
     pathname = mtllibname = NULL;
     objToWorldTransform = identity4();
   }
 
-  wfModel( const char *filename, TextureMode textureMode ) {
+  // The OpenGL buffers are not set up until the model is first drawn,
+  // so that a model can be read without an OpenGL context.
+
+  wfModel( const char *filename, TextureMode tm ) {
     texturesInitialized = false;
+    VAOsSetUp = false;
+    textureMode = tm;
     pathname = mtllibname = NULL;
     objToWorldTransform = identity4();
     read( filename );
-    setupVAO( textureMode );
   }
 
   ~wfModel() {
+    for (int i=0; i<groups.size(); i++)
+      delete groups[i];
+    for (int i=0; i<materials.size(); i++)
+      delete materials[i];
+    free( (void *) pathname );	/* (both from strdup() or malloc()) */
+    free( (void *) mtllibname );
   }
 
   void read( const char *filename );         /* instantiate this model from a file */
   void draw( GPUProgram * gpuProg, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS );
+  void buildVertexBuffers();                  /* interleaved, deduplicated vertices of each group */
   void setupVAO( TextureMode textureMode );
   void initTextures( TextureMode tm );        /* assign texture IDs and store all textures */
+  char *pathInModelDir( const char *name );   /* filename in this model's directory */
 
-  void checkVindex( int v ) {
-    if (v < 0 || v >= vertices.size()) {
+  static void checkVindex( int v, int numVertices, int lineNum ) {
+    if (v < 0 || v >= numVertices) {
       cerr << "error on line " << lineNum
-	   << ": vertex index " << v+1 << " is too large.  There are only "
-	   << vertices.size() << " vertices." << endl;
+	   << ": vertex index " << v+1 << " is out of range.  There are only "
+	   << numVertices << " vertices." << endl;
       abort();
     }
   }
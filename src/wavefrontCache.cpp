@@ -0,0 +1,623 @@
+/* wavefrontCache.cpp
+ *
+ * Binary cache of a Wavefront object and its BVH.
+ *
+ * The first time a model X.obj is read, the parsed model and its
+ * built BVH are written to X.obj.rtcache.  Later reads of X.obj
+ * memory-map the cache instead, which skips parsing, the face normal
+ * computation, and the BVH build.
+ *
+ * The cache records the size and modification time of X.obj and of
+ * its material library, and the BVH build parameters.  If any of
+ * these differ, or the cache is from a different version of this
+ * code, the cache is ignored and rewritten.
+ *
+ * The cache is written in the native byte order and layout of the
+ * classes, so it is not meant to be copied between machines.  The
+ * sizes of the classes are recorded to catch that.
+ */
+
+
+#include "headers.h"
+#include "wavefrontobj.h"
+#include "mappedFile.h"
+
+#include <sys/stat.h>
+#include <cstdint>
+#include <string>
+#include <fstream>
+
+
+#define CACHE_SUFFIX  ".rtcache"
+#define CACHE_VERSION 4
+
+bool WavefrontObj::useCache = true;
+
+
+class CacheHeader {
+ public:
+  char     magic[8];		/* "RTCACHE" */
+  uint32_t version;
+
+  // Sizes of the stored classes
+
+  uint32_t vec3Size, wfTriangleSize;
+  uint32_t bvhTriangleSize, triBlockSize, flatNodeSize, wideNodeSize, leafSize;
+  uint32_t bvhWidth;
+
+  // BVH build parameters
+
+  uint32_t useSAH;
+  int32_t  numSAHBins;
+  int32_t  maxLeafSize;
+  float    traversalCost;
+  float    intersectionCost;
+};
+
+
+/* The size and modification time of a file that the cache was made from */
+
+class CacheSource {
+ public:
+  int64_t size;
+  int64_t mtime;		/* nanoseconds */
+};
+
+
+static bool getCacheSource( const char *filename, CacheSource &src )
+
+{
+  struct stat st;
+
+  memset( &src, 0, sizeof(src) );
+
+  if (stat( filename, &st ) != 0)
+    return false;
+
+  src.size = st.st_size;
+
+#if defined(MACOS)
+  src.mtime = (int64_t) st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+  src.mtime = (int64_t) st.st_mtime * 1000000000;
+#else
+  src.mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+
+  return true;
+}
+
+
+static void makeCacheHeader( CacheHeader &h )
+
+{
+  memset( &h, 0, sizeof(h) );
+
+  strcpy( h.magic, "RTCACHE" );
+  h.version = CACHE_VERSION;
+
+  h.vec3Size        = sizeof(vec3);
+  h.wfTriangleSize  = sizeof(wfTriangle);
+  h.bvhTriangleSize = sizeof(BVH_triangle);
+  h.triBlockSize    = sizeof(BVH_triBlock);
+  h.flatNodeSize    = sizeof(BVH_flatNode);
+  h.wideNodeSize    = sizeof(BVH_wideNode);
+  h.leafSize        = sizeof(BVH_leaf);
+  h.bvhWidth        = BVH_WIDTH;
+
+  h.useSAH           = BVH::useSAH;
+  h.numSAHBins       = BVH::numSAHBins;
+  h.maxLeafSize      = BVH::maxLeafSize;
+  h.traversalCost    = BVH::traversalCost;
+  h.intersectionCost = BVH::intersectionCost;
+}
+
+
+
+/* Writes the cache.  Arrays are stored as a count then the elements,
+ * and strings as a length then the characters.
+ */
+
+class CacheWriter {
+
+  ofstream out;
+
+ public:
+
+  CacheWriter( const char *filename ) : out( filename, ios::binary ) {}
+
+  bool ok() { return (bool) out; }
+
+  void close() { out.close(); }
+
+  void write( const void *data, size_t size ) {
+    out.write( (const char *) data, size );
+  }
+
+  template<class T> void write( const T &x ) {
+    write( &x, sizeof(T) );
+  }
+
+  template<class T> void write( seq<T> &s ) {
+    int32_t n = s.size();
+    write( n );
+    if (n > 0)
+      write( &s[0], n * sizeof(T) );
+  }
+
+  void writeString( const char *s ) {
+    int32_t n = (s == NULL ? -1 : strlen(s));
+    write( n );
+    if (n > 0)
+      write( s, n );
+  }
+};
+
+
+/* Reads the cache from memory, failing on any overrun */
+
+class CacheReader {
+
+  const char *p, *end;
+
+ public:
+
+  bool ok;
+
+  CacheReader( const char *start, const char *_end ) {
+    p = start;
+    end = _end;
+    ok = true;
+  }
+
+  bool read( void *data, size_t size ) {
+    if (!ok || (size_t) (end - p) < size)
+      return ok = false;
+    memcpy( data, p, size );
+    p += size;
+    return true;
+  }
+
+  template<class T> bool read( T &x ) {
+    return read( &x, sizeof(T) );
+  }
+
+  template<class T> bool read( seq<T> &s ) {
+    int32_t n;
+    if (!read( n ) || n < 0 || (size_t) (end - p) / sizeof(T) < (size_t) n)
+      return ok = false;
+    s.resize( n );
+    if (n > 0)
+      memcpy( (void *) &s[0], p, n * sizeof(T) ); // (the file data may not be aligned for T)
+    p += n * sizeof(T);
+    return true;
+  }
+
+  char *readString() {
+    int32_t n;
+    if (!read( n ) || n < -1 || end - p < n) {
+      ok = false;
+      return NULL;
+    }
+    if (n == -1)
+      return NULL;
+    char *s = (char *) malloc( n+1 ); // (freed by free(), as for strdup())
+    memcpy( s, p, n );
+    s[n] = '\0';
+    p += n;
+    return s;
+  }
+};
+
+
+
+/* Find the files that the model was made from */
+
+static void getModelSources( wfModel *model, const char *filename, const char *mtllibname, CacheSource &objSource, CacheSource &mtlSource )
+
+{
+  getCacheSource( filename, objSource );
+
+  memset( &mtlSource, 0, sizeof(mtlSource) );
+
+  if (mtllibname != NULL) {
+    char *mtlFilename = model->pathInModelDir( mtllibname );
+    getCacheSource( mtlFilename, mtlSource );
+    delete [] mtlFilename;
+  }
+}
+
+
+static string cacheFilename( const char *filename )
+
+{
+  return string( filename ) + CACHE_SUFFIX;
+}
+
+
+
+/* Return the traversal stack entries needed below wide tree reference
+ * 'ref', as computed in BVH::buildWideSubtree(), or -1 if the subtree
+ * refers to anything out of range.  A node's children are built after
+ * it, so a child reference to an earlier node (which could make a
+ * cycle) is also rejected.
+ */
+
+static int wideStackNeeded( BVH &bvh, int ref )
+
+{
+  if (ref < 0)
+    return (~ref < bvh.leaves.size() ? 1 : -1);
+
+  if (ref >= bvh.wideNodes.size())
+    return -1;
+
+  BVH_wideNode &n = bvh.wideNodes[ref];
+
+  // A slot with an empty box is never traversed, so its reference is
+  // not used.  Any other slot (including one with NaN bounds) is.
+
+  bool used[ BVH_WIDTH ];
+  int  numChildren = 0;
+
+  for (int j=0; j<BVH_WIDTH; j++) {
+    used[j] = !(n.bounds[0][j] > n.bounds[3][j]);
+    if (used[j])
+      numChildren++;
+  }
+
+  int stackNeeded = 1;
+
+  for (int j=0; j<BVH_WIDTH; j++)
+    if (used[j]) {
+
+      if (n.child[j] >= 0 && n.child[j] <= ref)
+        return -1;
+
+      int childNeeded = wideStackNeeded( bvh, n.child[j] );
+      if (childNeeded < 0)
+        return -1;
+
+      stackNeeded = MAX( stackNeeded, childNeeded + numChildren-1 );
+    }
+
+  return stackNeeded;
+}
+
+
+
+/* Check that every index in a BVH read from the cache is in range, so
+ * that a damaged cache is rejected rather than traversed.
+ */
+
+static bool validCachedBVH( BVH &bvh )
+
+{
+  unsigned int numVertices  = bvh.vertices->size();
+  unsigned int numTexcoords = bvh.texcoords->size();
+  unsigned int numNormals   = bvh.normals->size();
+
+  for (int i=0; i<bvh.triangles.size(); i++) {
+
+    BVH_triangle &t = bvh.triangles[i];
+
+    if (t.v0 >= numVertices ||
+        t.v1 >= numVertices ||
+        t.v2 >= numVertices ||
+        t.materialID >= (unsigned int) bvh.materials.size() ||
+        t.faceID >= (unsigned int) bvh.facetnorms->size())
+      return false;
+
+    if (bvh.obj->hasVertexTexCoords &&
+        (t.t0 >= numTexcoords ||
+         t.t1 >= numTexcoords ||
+         t.t2 >= numTexcoords))
+      return false;
+
+    if (bvh.obj->hasVertexNormals &&
+        (t.n0 >= numNormals ||
+         t.n1 >= numNormals ||
+         t.n2 >= numNormals))
+      return false;
+  }
+
+  // Flattened tree (whose children always follow their parent)
+
+  for (int i=0; i<bvh.nodes.size(); i++) {
+
+    BVH_flatNode &n = bvh.nodes[i];
+
+    if (n.offset < 0)
+      return false;
+
+    if (n.isLeaf) {
+      if ((int64_t) n.offset + n.count > bvh.triangles.size())
+        return false;
+    } else {
+      if (n.offset <= i || (int64_t) n.offset + n.count > bvh.nodes.size())
+        return false;
+    }
+  }
+
+  // Wide tree leaves
+
+  for (int i=0; i<bvh.leaves.size(); i++) {
+
+    BVH_leaf &l = bvh.leaves[i];
+
+    if (l.offset < 0 || l.count < 0 || l.block < 0 ||
+        (int64_t) l.offset + l.count > bvh.triangles.size() ||
+        (int64_t) l.block + (l.count + BVH_TRI_BLOCK-1) / BVH_TRI_BLOCK > bvh.triBlocks.size())
+      return false;
+  }
+
+  // Wide tree, which is only traversed if there is a flattened root
+
+  if (bvh.nodes.size() == 0)
+    return true;
+
+  int stackNeeded = wideStackNeeded( bvh, bvh.wideRoot );
+
+  return (stackNeeded >= 1 && stackNeeded <= bvh.stackSize);
+}
+
+
+
+/* Write the model and BVH to the cache file */
+
+void WavefrontObj::writeCache( const char *filename )
+
+{
+  string cacheName = cacheFilename( filename );
+  string tmpName = cacheName + ".tmp";
+
+  CacheWriter out( tmpName.c_str() );
+
+  if (!out.ok()) {
+    cerr << "Warning: could not write the cache file " << cacheName << endl;
+    return;
+  }
+
+  CacheHeader header;
+  makeCacheHeader( header );
+  out.write( header );
+
+  CacheSource objSource, mtlSource;
+  getModelSources( obj, filename, obj->mtllibname, objSource, mtlSource );
+  out.write( objSource );
+  out.write( mtlSource );
+
+  // Model
+
+  out.writeString( obj->mtllibname );
+
+  uint8_t flags[2] = { bvh.obj->hasVertexNormals, bvh.obj->hasVertexTexCoords };
+  out.write( flags );
+
+  out.write( obj->objToWorldTransform );
+  out.write( obj->min );
+  out.write( obj->max );
+  out.write( obj->centre );
+  out.write( obj->radius );
+
+  out.write( obj->vertices );
+  out.write( obj->normals );
+  out.write( obj->texcoords );
+  out.write( obj->facetnorms );
+
+  int32_t numMaterials = obj->materials.size();
+  out.write( numMaterials );
+
+  for (int i=0; i<numMaterials; i++) {
+    wfMaterial *m = obj->materials[i];
+    out.writeString( m->name );
+    out.write( m->diffuse );
+    out.write( m->ambient );
+    out.write( m->specular );
+    out.write( m->emissive );
+    out.write( m->shininess );
+    out.write( m->alpha );
+    out.writeString( m->texmapName );
+  }
+
+  int32_t numGroups = obj->groups.size();
+  out.write( numGroups );
+
+  for (int i=0; i<numGroups; i++) {
+    wfGroup *g = obj->groups[i];
+    int32_t materialIndex = obj->materials.findIndex( g->material );
+    out.writeString( g->name );
+    out.write( materialIndex );
+    out.write( g->triangles );
+  }
+
+  // BVH
+
+  out.write( bvh.triangles );
+  out.write( bvh.triBlocks );
+  out.write( bvh.nodes );
+  out.write( bvh.wideNodes );
+  out.write( bvh.leaves );
+  out.write( (int32_t) bvh.wideRoot );
+  out.write( (int32_t) bvh.stackSize );
+
+  bool written = out.ok();
+  out.close();
+
+  if (!written || rename( tmpName.c_str(), cacheName.c_str() ) != 0) {
+    cerr << "Warning: could not write the cache file " << cacheName << endl;
+    remove( tmpName.c_str() );
+  }
+}
+
+
+
+/* Read the model and BVH from the cache file.  Returns false if there
+ * is no cache, or if it is out of date or unreadable.
+ */
+
+bool WavefrontObj::readCache( const char *filename )
+
+{
+  string cacheName = cacheFilename( filename );
+
+  MappedFile file;
+
+  if (!file.open( cacheName.c_str() ))
+    return false;
+
+  CacheReader in( file.data, file.end() );
+
+  // Check that the cache matches this code and the build parameters
+
+  CacheHeader header, expectedHeader;
+  makeCacheHeader( expectedHeader );
+
+  if (!in.read( header ) || memcmp( &header, &expectedHeader, sizeof(header) ) != 0)
+    return false;
+
+  // Read the model, then check that the sources are unchanged
+
+  CacheSource objSource, mtlSource;
+  in.read( objSource );
+  in.read( mtlSource );
+
+  wfModel *model = new wfModel();
+
+  model->pathname = strdup( filename );
+  model->mtllibname = in.readString();
+
+  CacheSource currentObjSource, currentMtlSource;
+  getModelSources( model, filename, model->mtllibname, currentObjSource, currentMtlSource );
+
+  if (!in.ok ||
+      memcmp( &objSource, &currentObjSource, sizeof(CacheSource) ) != 0 ||
+      memcmp( &mtlSource, &currentMtlSource, sizeof(CacheSource) ) != 0) {
+    delete model;
+    return false;
+  }
+
+  uint8_t flags[2] = { 0, 0 };
+  in.read( flags );
+
+  if (!in.ok) {
+    cerr << "Warning: the cache file " << cacheName << " is damaged, so it will be rebuilt" << endl;
+    delete model;
+    return false;
+  }
+
+  model->hasVertexNormals   = flags[0];
+  model->hasVertexTexCoords = flags[1];
+
+  in.read( model->objToWorldTransform );
+  in.read( model->min );
+  in.read( model->max );
+  in.read( model->centre );
+  in.read( model->radius );
+
+  in.read( model->vertices );
+  in.read( model->normals );
+  in.read( model->texcoords );
+  in.read( model->facetnorms );
+
+  int32_t numMaterials = 0;
+  in.read( numMaterials );
+
+  for (int i=0; i<numMaterials && in.ok; i++) {
+
+    char *name = in.readString();
+    wfMaterial *m = new wfMaterial( name == NULL ? "" : name );
+    free( name );
+
+    in.read( m->diffuse );
+    in.read( m->ambient );
+    in.read( m->specular );
+    in.read( m->emissive );
+    in.read( m->shininess );
+    in.read( m->alpha );
+    m->texmapName = in.readString();
+
+    if (m->texmapName != NULL) {
+      char *texFilename = model->pathInModelDir( m->texmapName );
+      m->loadTexmap( texFilename );
+      delete [] texFilename;
+    }
+
+    model->materials.add( m );
+  }
+
+  int32_t numGroups = 0;
+  in.read( numGroups );
+
+  for (int i=0; i<numGroups && in.ok; i++) {
+
+    char *name = in.readString();
+    wfGroup *g = new wfGroup( name == NULL ? "" : name );
+    free( name );
+
+    int32_t materialIndex = -1;
+    in.read( materialIndex );
+    in.read( g->triangles );
+
+    if (materialIndex < 0 || materialIndex >= model->materials.size()) {
+      in.ok = false;
+      delete g;
+      break;
+    }
+
+    g->material = model->materials[ materialIndex ];
+    model->groups.add( g );
+  }
+
+  if (!in.ok) {
+    cerr << "Warning: the cache file " << cacheName << " is damaged, so it will be rebuilt" << endl;
+    delete model;
+    return false;
+  }
+
+  // BVH
+
+  obj = model;
+
+  bvh.obj        = obj;
+  bvh.vertices   = &obj->vertices;
+  bvh.texcoords  = &obj->texcoords;
+  bvh.normals    = &obj->normals;
+  bvh.facetnorms = &obj->facetnorms;
+
+  for (int i=0; i<obj->groups.size(); i++)
+    bvh.materials.add( convertMaterial( obj->groups[i]->material ) );
+
+  int32_t wideRoot = 0;
+  int32_t stackSize = 1;
+
+  in.read( bvh.triangles );
+  in.read( bvh.triBlocks );
+  in.read( bvh.nodes );
+  in.read( bvh.wideNodes );
+  in.read( bvh.leaves );
+  in.read( wideRoot );
+  in.read( stackSize );
+
+  bvh.wideRoot = wideRoot;
+  bvh.stackSize = stackSize;
+
+  if (!in.ok || !validCachedBVH( bvh )) {
+    cerr << "Warning: the cache file " << cacheName << " is damaged, so it will be rebuilt" << endl;
+    for (int i=0; i<bvh.materials.size(); i++)
+      delete bvh.materials[i];
+    bvh.materials.clear();
+    bvh.triangles.clear();
+    bvh.triBlocks.clear();
+    bvh.nodes.clear();
+    bvh.wideNodes.clear();
+    bvh.leaves.clear();
+    delete obj;
+    obj = NULL;
+    return false;
+  }
+
+  cout << "BVH: " << bvh.triangles.size() << " triangles read from " << cacheName << endl;
+
+  return true;
+}
@@ -14,6 +14,10 @@
 class WavefrontObj : public Object {
 
   void copyWavefrontToBVH( BVH &bvh );
+  Material *convertMaterial( wfMaterial *fromMat );
+
+  bool readCache( const char *filename );  /* in wavefrontCache.cpp */
+  void writeCache( const char *filename );
 
  public:
 
@@ -21,12 +25,18 @@ class WavefrontObj : public Object {
 
   BVH bvh;			/* bounding volume hierarchy of triangle primitives */
 
+  static bool useCache;		/* read and write X.obj.rtcache for each X.obj */
+
   WavefrontObj() {}
 
   WavefrontObj( const char *filename ) {
+    if (useCache && readCache( filename ))
+      return;
     obj = new wfModel( filename, MIPMAP_LINEAR ); // Read the object
     copyWavefrontToBVH( bvh ); // Copy to the BVH
     bvh.buildTree(); // Build the BVH
+    if (useCache)
+      writeCache( filename );
   }
 
   void renderGL( GPUProgram * gpuProg, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS ) {
@@ -37,6 +47,27 @@ class WavefrontObj : public Object {
     return bvh.rayInt( rayStart, rayDir, objPartIndex, maxParam, intPoint, intNorm, intTexCoords, intParam, mat, intPartIndex );
   }
 
+  bool rayOccluded( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam ) {
+    return bvh.rayOccluded( rayStart, rayDir, objPartIndex, maxParam );
+  }
+
+  unsigned int packetRayInt( RayPacket &packet, unsigned int rayMask, int objPartIndex ) {
+    return bvh.packetRayInt( packet, rayMask, objPartIndex );
+  }
+
+  BBox bbox() {
+    BBox b;
+    if (bvh.nodes.size() > 0)
+      b = bvh.nodes[0].bbox;
+    else
+      b.makeEmpty();
+    return b;
+  }
+
+  bool isConvex() {
+    return false;
+  }
+
   vec3 textureColour( vec3 &p, int objPartIndex, float &alpha, vec3 &texCoords ) {
     return bvh.textureColour( p, objPartIndex, alpha, texCoords );
   }